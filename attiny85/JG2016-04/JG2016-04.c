@@ -1,37 +1,190 @@
 /**
   ******************************************************************************
-  * @file    attiny85/JG2016-03.c 
+  * @file    attiny85/JG2016-04/JG2016-04.c
   * @author  Jacqueline Goh - 43238266
   * @date    1-Aug-2016
-  * @brief   JG2016-03 Control main file
+  * @brief   JG2016-04 Control main file
   ******************************************************************************
   */
   
-#define F_CPU 125000UL
-
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/sfr_defs.h>
-#include <util/delay.h>
 #include <stdint.h>
 
-// Define set bit and clear bit macros
-#define sbi(sfr,bit) (sfr |= _BV(bit))
-#define cbi(sfr,bit) (sfr &= ~(_BV(bit)))
-
+#include "hal.h"
+#include "calib.h"
+#include "eventlog.h"
+#include "fixed.h"
+#ifdef TELEMETRY
+#include "telemetry.h"
+#endif
 
 #define SAMPLE_RATE     20
 #define SAMPLE_PERIOD   (1000/SAMPLE_RATE)
 #define BUBBLE_THRESH   8
-/* Maximum amount of air to enter a line
- * Depending on the sample rate, each positive sample indicates a volume of air
- * air volume = flow_rate * tube_diamter * sample_period / 2
- * e.g. sampling at 20Hz w 50% duty cycle = 50ms on time
- * 50ms @ flow rate of 10mm/s w. tube size of 2.5mm radius (20mm^2) = 10mm^3 = 0.01cm
- * Spec = 300mL, so we would need 3000 bubbles
+#ifdef SWEEP
+/* Host parameter sweep, see sweep.c. main becomes DetectorMain, run once
+ * per setting in a fresh process, and the settings below with no variable
+ * of their own are read from these. The sample rate and threshold are set
+ * through sample_ticks and thresh_tenths */
+extern uint16_t sweep_max_air;
+extern uint8_t sweep_filt_shift;
+#define MAX_AIR         sweep_max_air
+#define FILT_SHIFT      sweep_filt_shift
+#define FILT_SHIFT_MAX  (16 - ADC_BITS)
+#endif
+/* Air volume accounting
+ * Each positive sample means air filled the tube for the sample period
+ * air volume = flow_rate * tube_area * sample_period
+ * e.g. 50ms @ flow rate of 10mm/s w. tube size of 2.5mm radius (20mm^2) = 10mm^3
+ * Air is summed over a sliding window of AIR_WINDOW_MIN minutes, kept as
+ * AIR_BUCKETS buckets, and the alarm sounds once more than MAX_AIR uL
+ * (mm^3) has entered the line within the window.
  */
-#define MAX_AIR         100
-#define FILT_LENGTH     8
+#ifndef FLOW_RATE
+#define FLOW_RATE       10      /* mm/s */
+#endif
+#ifndef TUBE_AREA
+#define TUBE_AREA       20      /* mm^2 */
+#endif
+#ifndef MAX_AIR
+#define MAX_AIR         1000    /* uL per window */
+#endif
+#ifndef AIR_WINDOW_MIN
+#define AIR_WINDOW_MIN  15
+#endif
+#ifndef AIR_BUCKETS
+#define AIR_BUCKETS     15
+#endif
+#define AIR_BUCKET_TICKS (AIR_WINDOW_MIN * 60000UL / AIR_BUCKETS / TICK_MS)
+/* uL of air per tick of a positive sample, and per ms of a timed pulse, in
+ * 16.16 fixed point */
+#define AIR_PER_TICK_Q16 \
+    ((uint32_t)FLOW_RATE * TUBE_AREA * TICK_MS * 65536 / 1000)
+#define AIR_PER_MS_Q16  ((uint32_t)FLOW_RATE * TUBE_AREA * 65536 / 1000)
+#if AIR_BUCKET_TICKS > 65535
+#error "AIR_BUCKET_TICKS must fit the 16 bit task period"
+#endif
+/* Moving average filter length, kept a power of two so the divide is a shift.
+ * The running total of FILT_LENGTH ADC_BITS bit samples must fit in 16 bits */
+#ifndef FILT_SHIFT
+#define FILT_SHIFT      3
+#endif
+/* Largest FILT_SHIFT the sample buffer is sized for */
+#ifndef FILT_SHIFT_MAX
+#define FILT_SHIFT_MAX  FILT_SHIFT
+#endif
+#define FILT_LENGTH     (1 << FILT_SHIFT)
+#if FILT_SHIFT_MAX + ADC_BITS > 16
+#error "FILT_SHIFT too large for a 16 bit running total"
+#endif
+/* Spike rejection ahead of the moving average, built with -DMEDIAN_FILT.
+ * The output is the median of the last MEDIAN_LENGTH readings, or with
+ * -DHAMPEL the reading itself unless it lies more than HAMPEL_TENTHS/10
+ * median absolute deviations (MAD) from that median. Runs of up to
+ * MEDIAN_MID outlying readings are dropped, so a bubble is seen that many
+ * readings late */
+#ifndef MEDIAN_LENGTH
+#define MEDIAN_LENGTH   5
+#endif
+#define MEDIAN_MID      (MEDIAN_LENGTH / 2)
+/* 3 standard deviations, taken as 1.5 MAD (1.4826 for Gaussian noise) */
+#define HAMPEL_TENTHS   45
+#if !(MEDIAN_LENGTH & 1) || MEDIAN_LENGTH < 3
+#error "MEDIAN_LENGTH must be odd and at least 3"
+#endif
+#if defined(HAMPEL) && !defined(MEDIAN_FILT)
+#error "HAMPEL needs MEDIAN_FILT"
+#endif
+
+#define SAMPLE_TICKS    (SAMPLE_PERIOD / TICK_MS)
+/* Sensor LED settling time before the ADC is read. 0 with the long
+ * POWER_DOWN tick, when the HAL waits out a shorter settling time instead */
+#define SETTLE_TICKS    (SAMPLE_PERIOD / 4 / TICK_MS)
+/* With ADC_STROBE defined the HAL strobes the sensor LED and triggers the
+ * ADC from Timer0, and the decision uses the on minus off reading */
+#if defined(ADC_STROBE) && ADC_CHANNELS > 1
+#error "ADC_STROBE samples a single channel"
+#endif
+/* Bit per channel in the per channel flags */
+#define ALL_CHANNELS    ((1 << ADC_CHANNELS) - 1)
+#if SETTLE_TICKS + ADC_CHANNELS > SAMPLE_TICKS
+#error "The scan must fit in the sample period"
+#endif
+
+#ifdef ADAPTIVE_RATE
+/* Adaptive sampling: IDLE_RATE while readings sit above BURST_THRESH tenths
+ * of water_value, BURST_RATE from the first reading below it until QUIET_MS
+ * pass without another */
+#define IDLE_RATE       4
+#define BURST_RATE      40
+#define BURST_THRESH    9
+#define QUIET_MS        2000
+#define IDLE_TICKS      (1000 / IDLE_RATE / TICK_MS)
+#define BURST_TICKS     (1000 / BURST_RATE / TICK_MS)
+#define QUIET_TICKS     (QUIET_MS / TICK_MS)
+#if BURST_TICKS < SETTLE_TICKS + ADC_CHANNELS || IDLE_TICKS > 255
+#error "Sample periods must fit the scan and fit in 8 bits"
+#endif
+#endif
+/* Baseline tracking
+ * water_value follows LED and temperature drift as an exponential moving
+ * average of the bubble free readings, with a time constant of 2^TRACK_SHIFT
+ * samples (~13s at 20Hz). Readings more than 1/2^TRACK_GATE_SHIFT of
+ * water_value away from it are taken as bubble edges and left out.
+ */
+#define TRACK_SHIFT     8
+#define TRACK_GATE_SHIFT 3
+/* Hold the switch on this long to request a full recalibration */
+#define CAL_HOLD_TICKS  (2000 / TICK_MS)
+/* Save the calibration and air total to EEPROM every 5 minutes */
+#define SAVE_TICKS      (5 * 60000UL / TICK_MS)
+#if SAVE_TICKS > 65535
+#error "SAVE_TICKS must fit the 16 bit task period"
+#endif
+/* Flush the event log every 100ms once a batch has built up, and at least
+ * once a minute or straight away after an alarm */
+#define LOG_TICKS       (100 / TICK_MS)
+#define LOG_AGE_MAX     (60000 / (LOG_TICKS * TICK_MS))
+/* Log the tracked water_value once it moves by more than 1/32 */
+#define RECAL_LOG_SHIFT 5
+#ifdef PROFILE
+/* With -DPROFILE the HAL counters go out on the telemetry stream every 10
+ * seconds, as soon after as the serial output has drained */
+#ifndef TELEMETRY
+#error "PROFILE sends its counters with TELEMETRY"
+#endif
+#define PROFILE_TICKS   (10000 / TICK_MS)
+#endif
+#ifdef COMP_WAKE
+/* Comparator wake: between bubbles the sensor LED stays on and the
+ * comparator watches the sensor instead of the ADC sampling it. It is
+ * armed only while the bandgap sits between the bubble threshold and
+ * water_value less 1/2^COMP_MARGIN_SHIFT, and a check sample is still taken
+ * every COMP_CHECK_TICKS to keep the water value and the level current.
+ * The bandgap is fixed at ~1.1V, so the sensor front end must put water at
+ * ~1.17V to ~1.375V with the default threshold, above the 1V1 reference the
+ * ADC otherwise uses. The ADC reads against VCC in this build, and each
+ * calibration logs a LOG_COMP event if water falls outside that window */
+#if ADC_CHANNELS > 1 || defined(ADC_STROBE) || defined(TELEMETRY) || \
+    defined(POWER_DOWN)
+#error "COMP_WAKE watches one ADC sampled channel without the serial output"
+#endif
+#define COMP_CHECK_TICKS (1000 / TICK_MS)
+#define COMP_MARGIN_SHIFT 4
+#endif
+#ifdef PULSE_TIMING
+/* Pulse timing: air is measured from the timestamped sensor edges instead
+ * of a sample period per positive sample, see PulseTake. The edges come
+ * from the COMP_WAKE comparator: a trip is confirmed by a sample and the
+ * comparator is then armed again to follow the bubble to its trailing
+ * edge, so both edges are timed. Only when the level is not usable does
+ * sampling count the air, as without the option */
+#ifndef COMP_WAKE
+#error "PULSE_TIMING takes its edges from the COMP_WAKE comparator"
+#endif
+#if ADC_CHANNELS > 1 || defined(TELEMETRY) || defined(POWER_DOWN)
+#error "PULSE_TIMING times one channel from the Timer0 tick"
+#endif
+#endif
 
 
 // OCR values for the 7 notes within an octave
@@ -39,223 +192,859 @@
 // Assuming a timer of 62.5kHz (to fit in 8 bits)
 //const uint8_t notes[7] = {239, 213, 190, 179, 159, 142, 127};
 const uint8_t notes[2] = {239, 20};
+// Calibration chirp notes of CHIRP_MS, played by the tick interrupt so at
+// least a tick long: 5ms each (16ms with POWER_DOWN) for the 1ms they were
+#define CHIRP_MS        1
+#define CHIRP_TICKS     ((CHIRP_MS + TICK_MS - 1) / TICK_MS)
+const uint8_t chirp_ticks[2] = {CHIRP_TICKS, CHIRP_TICKS};
+
+// Alarm pattern played in the background, notes of 100ms then a 200ms rest
+const uint8_t alarm_notes[5] = {239, 20, 239, 20, 0};
+const uint8_t alarm_ticks[5] = {100 / TICK_MS, 100 / TICK_MS, 100 / TICK_MS,
+                                100 / TICK_MS, 200 / TICK_MS};
+
+/* Scheduler task, run every period ticks */
+typedef struct {
+    void (*run)(void);
+    uint16_t period;
+    uint16_t count;
+} task_t;
 
-// Interrupt counter for switch
-volatile uint8_t timer_flag;
+/* Detector state shared between the tasks. Per channel state is kept as an
+ * array per field, indexed by channel, and per channel flags as one bit per
+ * channel in a byte */
+uint16_t water_value[ADC_CHANNELS];
+/* water_value << TRACK_SHIFT, the moving average behind it */
+uint32_t water_track[ADC_CHANNELS];
+/* water_value when it was last logged */
+uint16_t water_logged[ADC_CHANNELS];
+/* Bubble threshold in tenths of water_value and as an 8.8 scale, restored
+ * from EEPROM at boot */
+uint8_t thresh_tenths = BUBBLE_THRESH;
+uint16_t thresh_q8 = TENTHS_Q8(BUBBLE_THRESH);
+/* water_value scaled by thresh_q8, updated with water_value */
+uint16_t bubble_thresh[ADC_CHANNELS];
+/* Channels whose next reading should become the water value */
+uint8_t calibrate;
+/* Ticks the switch has been held on, saturates at CAL_HOLD_TICKS */
+uint16_t switch_ticks = CAL_HOLD_TICKS;
+uint8_t sample_ticks = SAMPLE_TICKS;
+uint8_t sample_phase;
+/* Channels with a bubble present */
+uint8_t bubble;
+uint8_t alarm_on;
+uint8_t chirp;
+/* Ticks since boot, timestamps the event log */
+uint32_t uptime;
+/* Tick of the first reading of the current bubble */
+uint32_t bubble_start[ADC_CHANNELS];
+/* Set while a calibration save is waiting for the EEPROM */
+uint8_t save_pending;
+/* LogTask runs since the event log was last written */
+uint16_t log_age;
+#ifdef PROFILE
+/* Ticks since the profiling counters were last sent */
+uint16_t profile_age;
+#endif
+
+/* Air seen per bucket of the sliding window and the window total, in uL.
+ * air_frac carries the fraction of a uL (16.16) between additions */
+uint16_t air_buckets[ADC_CHANNELS][AIR_BUCKETS];
+uint32_t air_total[ADC_CHANNELS];
+uint16_t air_frac[ADC_CHANNELS];
+uint8_t air_index;
+/* uL of air seen over the life of the unit on all channels, kept in EEPROM */
+uint32_t air_lifetime;
+
+#ifdef ADAPTIVE_RATE
+/* SCALE_Q8(water_value, BURST_THRESH), updated with water_value */
+uint16_t burst_thresh[ADC_CHANNELS];
+/* Ticks since the last reading below burst_thresh */
+uint16_t quiet_ticks;
+/* Set when any channel in the current scan was below burst_thresh */
+uint8_t burst_near;
+#endif
 
+#ifdef COMP_WAKE
+/* Bandgap level the comparator trips below, measured every check sample */
+uint16_t comp_level;
+uint8_t comp_armed;
+/* Set when the comparator tripped before the current sample */
+uint8_t comp_trip;
+#ifdef PULSE_TIMING
+/* Set when the comparator has timed the air up to the current sample */
+uint8_t comp_timed;
+#endif
+/* Measure comp_level on the next sample */
+uint8_t comp_check = 1;
+uint16_t comp_ticks;
+/* Check the level against the water value once calibration is done */
+uint8_t comp_report = 1;
+#endif
+
+#ifdef SWEEP
+/* Shortest sample period the scan fits in */
+const uint8_t sweep_min_ticks = SETTLE_TICKS + ADC_CHANNELS;
+#endif
+
+#ifdef AVG_FILT
+/* Moving average filter ring buffers and running totals */
+uint16_t filt_samples[ADC_CHANNELS][1 << FILT_SHIFT_MAX];
+uint16_t filt_total[ADC_CHANNELS];
+uint8_t filt_index[ADC_CHANNELS];
+#endif
+
+#ifdef MEDIAN_FILT
+/* Median filter windows, in arrival order and kept sorted */
+uint16_t med_samples[ADC_CHANNELS][MEDIAN_LENGTH];
+uint16_t med_sorted[ADC_CHANNELS][MEDIAN_LENGTH];
+uint8_t med_index[ADC_CHANNELS];
+#endif
+
+#ifdef AVG_FILT
 /**
- * @brief Sets the timer compare and OCR registers for timer 1 to play a tone
- *        for a specified duration. Output is on PB1
- * @param ocr - ocr value to enter into register
- * @param duration - time in ms to play the note
- * @return None
- */
-void PlayTone(uint8_t ocr, uint8_t duration)
+  * @brief Calculates the output of a moving average filter. The last
+  *        FILT_LENGTH samples are kept in a ring buffer with a running total,
+  *        so each call costs the same regardless of the filter length.
+  * @param ch - sensor channel
+  * @param new_sample - newest sample for the filter
+  * @return output from filter (uint16_t)
+  */
+uint16_t AvgFilt(uint8_t ch, uint16_t new_sample)
 {
-    TCCR1 = (1 << CTC1) | (1 << COM1A0) | (1 << CS11); // Start OC w. prescaler of 2
-    OCR1C = ocr; // set the OCR
-    _delay_ms(duration);
-    TCCR1 = (1 << CTC1) | (1 << COM1A0); // stop the counter
+    uint8_t i = filt_index[ch];
+
+    /* Swap the oldest sample out of the running total for the newest */
+    filt_total[ch] -= filt_samples[ch][i];
+    filt_total[ch] += new_sample;
+    filt_samples[ch][i] = new_sample;
+    filt_index[ch] = (i + 1) & (FILT_LENGTH - 1);
+
+    return filt_total[ch] >> FILT_SHIFT;
 }
 
 /**
- * @brief Loops through the seven notes in "notes" and plays each for 1 ms
- * @param None
- * @return None
- */
-void PlayAlarm(void)
+  * @brief Fills the moving average filter with a single value, e.g. after
+  *        calibration, so the output does not ramp up from zero.
+  * @param ch - sensor channel
+  * @param sample - value to fill the filter with
+  * @return Nothing
+  */
+void AvgFiltFill(uint8_t ch, uint16_t sample)
+{
+    uint8_t i;
+
+    for(i = 0; i < FILT_LENGTH; i++) {
+        filt_samples[ch][i] = sample;
+    }
+    filt_total[ch] = sample << FILT_SHIFT;
+    filt_index[ch] = 0;
+}
+#endif
+
+#ifdef MEDIAN_FILT
+/**
+  * @brief Calculates the output of the median (or Hampel) filter. The
+  *        window is kept sorted: the oldest sample's slot is found and slid
+  *        to where the newest belongs, so an update is a few compares and
+  *        moves rather than a sort. With HAMPEL the MAD is read off the
+  *        sorted window by merging the deviations either side of the median.
+  * @param ch - sensor channel
+  * @param new_sample - newest sample for the filter
+  * @return output from filter (uint16_t)
+  */
+uint16_t MedianFilt(uint8_t ch, uint16_t new_sample)
+{
+    uint16_t *sorted = med_sorted[ch];
+    uint16_t old, median;
+    uint8_t i = med_index[ch];
+#ifdef HAMPEL
+    uint8_t lo = MEDIAN_MID, hi = MEDIAN_MID;
+    uint16_t mad = 0, dev;
+#endif
+
+    old = med_samples[ch][i];
+    med_samples[ch][i] = new_sample;
+    med_index[ch] = i == MEDIAN_LENGTH - 1 ? 0 : i + 1;
+
+    /* Replace the oldest sample in the sorted window with the newest,
+     * moving the slot up or down until the order holds again */
+    i = 0;
+    while(sorted[i] != old) {
+        i++;
+    }
+    while(i < MEDIAN_LENGTH - 1 && sorted[i + 1] < new_sample) {
+        sorted[i] = sorted[i + 1];
+        i++;
+    }
+    while(i > 0 && sorted[i - 1] > new_sample) {
+        sorted[i] = sorted[i - 1];
+        i--;
+    }
+    sorted[i] = new_sample;
+    median = sorted[MEDIAN_MID];
+
+#ifdef HAMPEL
+    /* The deviations grow outwards from the median on both sides, so the
+     * median deviation is the MEDIAN_MID'th smallest taken from either */
+    for(i = 0; i < MEDIAN_MID; i++) {
+        if(median - sorted[lo - 1] <= sorted[hi + 1] - median) {
+            mad = median - sorted[--lo];
+        } else {
+            mad = sorted[++hi] - median;
+        }
+    }
+    dev = new_sample > median ? new_sample - median : median - new_sample;
+    if(dev <= SCALE_Q8(mad, HAMPEL_TENTHS)) {
+        return new_sample;
+    }
+#endif
+    return median;
+}
+
+/**
+  * @brief Fills the median filter window with a single value, e.g. after
+  *        calibration, so the first readings are not taken as spikes.
+  * @param ch - sensor channel
+  * @param sample - value to fill the filter with
+  * @return Nothing
+  */
+void MedianFiltFill(uint8_t ch, uint16_t sample)
 {
-    uint8_t i = 0;
-    for(i = 0; i < 2; i++) {
-        PlayTone(notes[i], 1);
+    uint8_t i;
+
+    for(i = 0; i < MEDIAN_LENGTH; i++) {
+        med_samples[ch][i] = sample;
+        med_sorted[ch][i] = sample;
     }
+    med_index[ch] = 0;
 }
+#endif
 
 /**
-  * @brief  ADC initialisation. Sets the ADMUX and ADCSRA registers.
+  * @brief  Updates the water value and precomputes the bubble threshold
+  *         from it
+  * @param ch - sensor channel
+  * @param value - ADC reading of the sensor with water in the line
   * @return Nothing
   */
-void ADCInit (void)
+void SetThresholds (uint8_t ch, uint16_t value)
 {
-    /* Clear ADEN bit of register - halts all ADC processes */
-    cbi(ADCSRA, ADEN);
-    /* Setup ADMUX register */
-    ADMUX = (0 << REFS2) | (1 << REFS1) | (0 << REFS0); /* Set reference voltage to 1V1 */
-    /* Select PB2 (ADC1) with single ended input */
-    ADMUX |= (0 << MUX3) | (0 << MUX2) | (0 << MUX1) | (1 << MUX0); 
-    
-    ADCSRA |= (0 << ADATE); /* Auto trigger disabled */
-    /*
-     * Recommended ADC clock is between 50kHz and 200kHz
-     * If using internal 8MHz clock, prescaler must be 128 or 64
-     * If using 125kHz clock, prescaler must be 2 --> 62.5kHz
-     */
-    ADCSRA |= (0 << ADPS2) | (0 << ADPS1) | (1 << ADPS0); /* Prescaler of 2 */
-
-    /* Enable ADC. Ref and channel selections will not go into effect until set */
-    sbi(ADCSRA, ADEN);
-}   
+    water_value[ch] = value;
+    bubble_thresh[ch] = ((uint32_t)value * thresh_q8) >> 8;
+#ifdef ADAPTIVE_RATE
+    burst_thresh[ch] = SCALE_Q8(value, BURST_THRESH);
+#endif
+}
 
 /**
-  * @brief  Interrupt initialisation. Sets the GIMSK and PCMSK registers.
+  * @brief  Sets a new water value from a calibration and restarts the
+  *         baseline tracking from it
+  * @param ch - sensor channel
+  * @param value - ADC reading of the sensor with water in the line
   * @return Nothing
   */
-void IntInit (void)
+void SetWaterValue (uint8_t ch, uint16_t value)
 {
-    /* Enable external interrupts */
-    sbi(GIMSK, PCIE);
-    /* Enable PCINT3 */
-    sbi(PCMSK, PCINT3);
-    /* Enable interrupts */
-    sei();
-} 
+    water_track[ch] = (uint32_t)value << TRACK_SHIFT;
+    water_logged[ch] = value;
+    SetThresholds(ch, value);
+}
 
 /**
- * @brief Retrieves the the 10bit value from the analog input on PB4
- * @return 10 bit digital value
- */
-uint16_t ADCGet (void)
+  * @brief  Feeds a bubble free reading into the channel's water value
+  *         average. Costs an add and a shift per sample, so the baseline
+  *         follows drift without ever pausing detection.
+  * @param ch - sensor channel
+  * @param value - (filtered) reading that was not a bubble
+  * @return Nothing
+  */
+void TrackWater (uint8_t ch, uint16_t value)
 {
-    uint8_t high, low;
-    sbi(ADCSRA, ADSC); /* Start conversion */
-    while(bit_is_set(ADCSRA, ADSC)); /* Wait for conversion to finish */
+    uint16_t margin = water_value[ch] >> TRACK_GATE_SHIFT;
 
-    /* Lower byte must be read first */
-    low = ADCL;
-    high = ADCH;
+    if(value > water_value[ch] + margin || value + margin < water_value[ch]) {
+        return;
+    }
+    /* Decay by the rounded average before the add, so a steady input
+     * settles on exactly that value from either side. A negative step
+     * wraps and still adds correctly */
+    water_track[ch] += value -
+        ((water_track[ch] + (1 << (TRACK_SHIFT - 1))) >> TRACK_SHIFT);
 
-    return (high << 8) | low;
+    /* Rounded, the thresholds only need redoing when it changes */
+    value = (water_track[ch] + (1 << (TRACK_SHIFT - 1))) >> TRACK_SHIFT;
+    if(value == water_value[ch]) {
+        return;
+    }
+    SetThresholds(ch, value);
+
+    margin = water_logged[ch] >> RECAL_LOG_SHIFT;
+    if(value > water_logged[ch] + margin ||
+            value + margin < water_logged[ch]) {
+        LogEvent(LOG_RECAL, uptime, LOG_CH(ch, value));
+        water_logged[ch] = value;
+    }
 }
 
+#ifdef ADAPTIVE_RATE
 /**
-  * @brief  Blinks LED once for ~200ms. Toggles the B0 GPIO Pin.
+  * @brief  Picks the sample period for the next scan. Any reading heading
+  *         towards the bubble threshold switches to burst sampling, which
+  *         holds until QUIET_TICKS pass without another.
+  * @param  near - non-zero if any (filtered) reading in the scan was below
+  *         burst_thresh
   * @return Nothing
   */
-void BlinkLED (void)
+void AdaptRate (uint8_t near)
 {
-    /* Set B0 high */
-    sbi(PORTB, PORTB0);
-    _delay_ms(200);
-    
-    /* Set B0 low */
-    cbi(PORTB, PORTB0);
-    _delay_ms(100);
+    uint8_t ticks = sample_ticks;
+
+    if(near) {
+        quiet_ticks = 0;
+        ticks = BURST_TICKS;
+    } else if(sample_ticks != IDLE_TICKS) {
+        quiet_ticks += sample_ticks;
+        if(quiet_ticks >= QUIET_TICKS) {
+            ticks = IDLE_TICKS;
+        }
+    }
+
+    if(ticks != sample_ticks) {
+        sample_ticks = ticks;
+#ifdef ADC_STROBE
+        StrobeInit(ticks);
+#endif
+    }
 }
+#endif
 
 /**
-  * @brief Calculates the output of a moving average filter.
-  * @param old_sample - oldest sample from the filter, new_sample - newest
-  * sample from the filter, total - sum of FILT_LENGTH samples
-  * @return output from filter (uint16_t)
+  * @brief  Save task. Stores the water value, threshold and lifetime air
+  *         total in EEPROM. Also run straight after a calibration.
+  * @return Nothing
   */
-uint16_t AvgFilt(uint16_t *samples, uint16_t new_sample)
+void SaveTask (void)
 {
-    uint16_t total = 0;
-    uint8_t i;
-    
-    for(i = 0; i < FILT_LENGTH; i++) {
-        /* If we reach the end of the samples, replace with new_sample */
-        if(i == 7) { 
-            samples[i] = new_sample;
-        }
-        /* Update each sample with the next newest */
-        samples[i] = samples[i+1];
-        /* Add the newly written samples */
-        total += samples[i];
+    calib_t calib;
+    uint8_t ch;
+
+    for(ch = 0; ch < ADC_CHANNELS; ch++) {
+        calib.water_value[ch] = water_value[ch];
     }
-    
-    return (total / FILT_LENGTH);
+    calib.thresh = thresh_tenths;
+    calib.air_total = air_lifetime;
+    /* The EEPROM may be busy with the event log, LogTask retries */
+    save_pending = !CalibSave(&calib);
 }
 
-int main (void)
+/**
+  * @brief  Adds air to the current bucket of the channel's sliding window
+  *         and raises the alarm if the window total is over MAX_AIR.
+  * @param  ch - sensor channel
+  * @param  air - uL of air in 16.16 fixed point, e.g. the sample period
+  *         of a positive sample times AIR_PER_TICK_Q16
+  * @return Nothing
+  */
+void AirAdd (uint8_t ch, uint32_t air)
 {
-    uint8_t i = 0;
-    uint16_t water_value, on_value;
-    uint16_t bubble_count = 0;
-    /* Set clock prescaler to 64 (125kHz clock speed) */
-    CLKPR = (1 << CLKPCE) | (0 << CLKPS3) | (0 << CLKPS2) | (0 << CLKPS1) | (0 << CLKPS0);
-    CLKPR = (0 << CLKPCE) | (0 << CLKPS3) | (1 << CLKPS2) | (1 << CLKPS1) | (0 << CLKPS0);    
-    
-    /* Set B4, B1 and B0 to output */
-    DDRB = (1 << DDB4) | (1 << DDB1) | (1 << DDB0);
-    ADCInit();
-    IntInit();
+    uint16_t ul;
 
-    /* Indicate that calibration is required */
-    timer_flag = 1;
+    air += air_frac[ch];
+    ul = air >> 16;
+    air_frac[ch] = air;
 
-    while(1) {
-        /* React to switch turn on */
-        if(timer_flag) {
-            /* Turn on indicator LED for initialisation */
-            sbi(PORTB, PORTB0);
-            sbi(PORTB, PORTB4);
-            _delay_ms(100);
-            /* Initilise water value */
-            water_value = ADCGet();
-            _delay_ms(100);;
-            cbi(PORTB, PORTB4);
+    air_buckets[ch][air_index] += ul;
+    air_total[ch] += ul;
+    air_lifetime += ul;
+    if(air_total[ch] > MAX_AIR && !alarm_on) {
+        alarm_on = 1;
+        LogEvent(LOG_ALARM, uptime, LOG_CH(ch, air_total[ch]));
+        /* Write the log out on the next LogTask */
+        log_age = LOG_AGE_MAX;
+    }
+}
+
+/**
+  * @brief  Runs the bubble decision on a new sensor reading. When a
+  *         calibration has been requested the reading becomes the
+  *         channel's water value instead, and once every channel has one
+  *         they are saved to EEPROM.
+  * @param  ch - sensor channel
+  * @param  on_value - sensor reading with the LED on
+  * @return Nothing
+  */
+void Detect (uint8_t ch, uint16_t on_value)
+{
+    uint8_t mask = 1 << ch;
+    uint32_t units;
+#ifdef TELEMETRY
+    uint16_t raw = on_value;
+#endif
+
+    if(calibrate & mask) {
+        /* Calibration requested, take this reading as the water value */
+        SetWaterValue(ch, on_value);
+#ifdef MEDIAN_FILT
+        MedianFiltFill(ch, on_value);
+#endif
 #ifdef AVG_FILT
-            /* Fill first few samples */
-            for(i = 0; i<FILT_LENGTH; i++) {
-                on_value = AvgFilt(samples, ADCGet());
-            }
+        AvgFiltFill(ch, on_value);
+#endif
+        LogEvent(LOG_CAL, uptime, LOG_CH(ch, on_value));
+#ifdef COMP_WAKE
+        comp_report = 1;
+#endif
+#ifdef TELEMETRY
+        TelemetrySample(uptime, sample_ticks, ch, raw, raw);
 #endif
-            cbi(PORTB, PORTB0);
-            PlayAlarm();
-            i = 0;
-            timer_flag = 0;
+        calibrate &= ~mask;
+        if(!calibrate) {
+            chirp = 1;
+            SaveTask();
         }
+        return;
+    }
 
-        /* TODO: turn on and off ADC, and have appropriate delay between */
-        /* ADC retreival */
-        _delay_ms(SAMPLE_PERIOD / 2); /* Off time */
-        sbi(PORTB, PORTB4); /* Turn on sensor LED */
+#ifdef MEDIAN_FILT
+    on_value = MedianFilt(ch, on_value);
+#endif
 #ifdef AVG_FILT
-        on_value = AvgFilt(samples, ADCGet());
+    on_value = AvgFilt(ch, on_value);
 #endif
-        _delay_ms(SAMPLE_PERIOD / 4); /* On time / 2 */
-        on_value = ADCGet();
-        _delay_ms(SAMPLE_PERIOD / 4); /* On time / 2 */
+#ifdef TELEMETRY
+    TelemetrySample(uptime, sample_ticks, ch, raw, on_value);
+#endif
+    if(on_value < bubble_thresh[ch]) {
+        /* Bubble detected */
+        if(!(bubble & mask)) {
+            bubble |= mask;
+            bubble_start[ch] = uptime;
+        }
+#ifdef PULSE_TIMING
+        /* The comparator has timed the air up to this sample */
+        if(!comp_timed)
+#endif
+        AirAdd(ch, sample_ticks * AIR_PER_TICK_Q16);
+    } else {
+        if(bubble & mask) {
+            bubble &= ~mask;
+            units = LogUnits(uptime - bubble_start[ch]);
+            LogEvent(LOG_BUBBLE, bubble_start[ch], LOG_CH(ch, units));
+        }
+        TrackWater(ch, on_value);
+    }
+#ifdef ADAPTIVE_RATE
+    /* After the air count, which weights this reading by the period it
+     * was taken over. The rate changes once the whole scan is in */
+    if(on_value < burst_thresh[ch]) {
+        burst_near = 1;
+    }
+    if(ch == ADC_CHANNELS - 1) {
+        AdaptRate(burst_near);
+        burst_near = 0;
+    }
+#endif
+}
 
-        i++;
-        cbi(PORTB, PORTB4); /* Turn off sensor LED */
-
-        /* Check if a bubble was detected */
-        if(on_value < (BUBBLE_THRESH*water_value/10)){
-            /* Bubble detected */
-            if(++bubble_count > MAX_AIR) {
-                /* Sound alarm indefinitely */
-                sbi(PORTB, PORTB0);
-                while(1) {
-                    PlayAlarm();
-                }
+#ifdef COMP_WAKE
+/**
+  * @brief  Checks if the bandgap is a usable level: below the water value by
+  *         a margin, so drift does not trip it, and above the bubble
+  *         threshold, so a bubble does
+  * @return 1 if usable, 0 if the comparator can not watch this water value
+  */
+uint8_t CompUsable (void)
+{
+    return comp_level >= bubble_thresh[0] &&
+           comp_level + (water_value[0] >> COMP_MARGIN_SHIFT) <=
+           water_value[0];
+}
+
+/**
+  * @brief  Arms the comparator after a sample if the level is usable
+  * @return 1 if armed, 0 to keep sampling
+  */
+uint8_t CompWatch (void)
+{
+    if(calibrate || bubble || !CompUsable()) {
+        return 0;
+    }
+#ifdef ADAPTIVE_RATE
+    /* Let a burst run out first */
+    if(sample_ticks != IDLE_TICKS) {
+        return 0;
+    }
+#endif
+    ADCPower(0);
+    CompArm(1);
+    comp_armed = 1;
+    return 1;
+}
+
+#ifdef PULSE_TIMING
+/**
+  * @brief  Arms the comparator again once a sample has confirmed a bubble,
+  *         so the rest of it and its trailing edge are timed instead of
+  *         sampled. Needs the same usable level as CompWatch.
+  * @return 1 if armed, 0 to keep sampling
+  */
+uint8_t CompFollow (void)
+{
+    if(calibrate || !bubble || !CompUsable()) {
+        return 0;
+    }
+    ADCPower(0);
+    CompArm(1);
+    comp_armed = 1;
+    return 1;
+}
+#endif
+#endif
+
+#ifdef ADC_STROBE
+/**
+  * @brief  Sensing task for the timer triggered ADC. The LED strobe and both
+  *         conversions are run by the HAL, this only picks up each finished
+  *         on/off pair.
+  * @return Nothing
+  */
+void SenseTask (void)
+{
+    uint16_t on_value, off_value;
+
+    if(StrobeGet(&on_value, &off_value)) {
+        /* Subtract the dark reading to reject ambient light */
+        Detect(0, on_value > off_value ? on_value - off_value : 0);
+    }
+}
+#else
+/**
+  * @brief  Sensing task. Runs every tick and steps through the sample period:
+  *         the sensor LED and ADC are turned on at the start of the period
+  *         and the ADC is read SETTLE_TICKS later, one channel per tick, then
+  *         both are turned off until the next period. Because it is
+  *         tick driven the sample period does not depend on how long the
+  *         other tasks take. With COMP_WAKE the comparator takes over
+  *         between samples while armed, and a trip or a due check sample
+  *         reads the sensor at once. With PULSE_TIMING a bubble that sample
+  *         confirms is followed by the comparator, and read again once the
+  *         sensor is back above the level.
+  * @return Nothing
+  */
+void SenseTask (void)
+{
+    uint16_t on_value;
+    uint8_t ch;
+
+#ifdef COMP_WAKE
+    if(++comp_ticks >= COMP_CHECK_TICKS) {
+        comp_ticks = 0;
+        comp_check = 1;
+    }
+    if(comp_armed) {
+#ifdef PULSE_TIMING
+        if(bubble) {
+            /* Following a bubble, sample again after its trailing edge */
+            if(CompBelow() && !calibrate) {
+                return;
             }
-            sbi(PORTB, PORTB0);
-        } else if (i == 200) {
-            /* Recalculate water_value every 10 seconds */
-            sbi(PORTB, PORTB4);
-            _delay_ms(50);
-            /* Initilise water value */
-            water_value = ADCGet();
-            _delay_ms(50);;
-            cbi(PORTB, PORTB4);
-            i = 0;
-        } else {
-            cbi(PORTB, PORTB0);
+        } else
+#endif
+        if(!CompTripped() && !comp_check && !calibrate) {
+            return;
         }
+        comp_trip = !bubble && CompTripped();
+#ifdef PULSE_TIMING
+        comp_timed = 1;
+#endif
+        comp_armed = 0;
+        CompArm(0);
+        /* The LED has stayed on, read straight away */
+        ADCPower(1);
+        sample_phase = SETTLE_TICKS;
+#ifdef ADAPTIVE_RATE
+        if(comp_trip) {
+            AdaptRate(1);
+        }
+#endif
+    }
+#endif
+    if(sample_phase == 0) {
+        /* The LED and ADC are only powered for the sample window */
+        SensorLED(1);
+        ADCPower(1);
+#if SETTLE_TICKS == 0
+        SensorSettle();
+#endif
+    }
+    /* Wraps to out of range before SETTLE_TICKS */
+    ch = sample_phase - SETTLE_TICKS;
+    if(ch < ADC_CHANNELS) {
+        on_value = ADCGet();
+#if ADC_CHANNELS > 1
+        /* Switch the mux now so the next input settles while Detect and
+         * the other tasks run */
+        ADCSelect(ch == ADC_CHANNELS - 1 ? 0 : ch + 1);
+#endif
+#ifdef COMP_WAKE
+        /* Calibration is checked against a fresh level */
+        if(comp_check || calibrate) {
+            comp_level = CompLevel();
+            comp_check = 0;
+        }
+#else
+        if(ch == ADC_CHANNELS - 1) {
+            SensorLED(0);
+            ADCPower(0);
+        }
+#endif
+        Detect(ch, on_value);
+#ifdef COMP_WAKE
+        /* A bubble that had passed by the time it was sampled is logged
+         * with no duration */
+        if(comp_trip && !bubble) {
+            LogEvent(LOG_BUBBLE, uptime, LOG_CH(0, 0));
+        }
+        comp_trip = 0;
+        /* Report a water value the comparator can not watch rather than
+         * quietly sampling from then on */
+        if(comp_report && !calibrate) {
+            comp_report = 0;
+            if(!CompUsable()) {
+                LogEvent(LOG_COMP, uptime, LOG_CH(0, comp_level));
+            }
+        }
+#ifdef PULSE_TIMING
+        comp_timed = 0;
+        if(!CompWatch() && !CompFollow()) {
+#else
+        if(!CompWatch()) {
+#endif
+            SensorLED(0);
+            ADCPower(0);
+        }
+#endif
+    }
 
+    if(++sample_phase >= sample_ticks) {
+        sample_phase = 0;
     }
-    return 0;
 }
+#endif
 
 /**
- * @brief PCINT0 external pin interrupt on pin B3
- * @param PCINT0_vect - External interrupt vector
- * @return Nothing
- */
-ISR(PCINT0_vect)
+  * @brief  Air window task. Every AIR_BUCKET_TICKS the oldest bucket drops
+  *         out of the window total and is reused for the next interval.
+  * @return Nothing
+  */
+void AirTask (void)
+{
+    uint8_t ch;
+
+    if(++air_index == AIR_BUCKETS) {
+        air_index = 0;
+    }
+    for(ch = 0; ch < ADC_CHANNELS; ch++) {
+        air_total[ch] -= air_buckets[ch][air_index];
+        air_buckets[ch][air_index] = 0;
+    }
+}
+
+/**
+  * @brief  Switch task. A full recalibration is only requested once the
+  *         switch has been held on for CAL_HOLD_TICKS after being turned on,
+  *         so short presses and bounce are ignored.
+  * @return Nothing
+  */
+void SwitchTask (void)
+{
+    if(timer_flag) {
+        /* Switch changed, restart the hold time */
+        timer_flag = 0;
+        switch_ticks = 0;
+    }
+    if(switch_ticks < CAL_HOLD_TICKS) {
+        if(!SwitchRead()) {
+            switch_ticks = CAL_HOLD_TICKS;
+        } else if(++switch_ticks == CAL_HOLD_TICKS) {
+            calibrate = ALL_CHANNELS;
+        }
+    }
+}
+
+/**
+  * @brief  Status LED task. PB0 is on while waiting for calibration, while a
+  *         bubble is present and once the alarm has been raised.
+  * @return Nothing
+  */
+void StatusTask (void)
 {
-    timer_flag = 1;
+    StatusLED(calibrate || bubble || alarm_on);
 }
 
+/**
+  * @brief  Alarm task. Chirps once after calibration and starts the alarm
+  *         pattern once the maximum amount of air has been exceeded. Both
+  *         play in the background so sensing carries on.
+  * @return Nothing
+  */
+void AlarmTask (void)
+{
+    if(chirp) {
+        chirp = 0;
+        ToneStart(notes, chirp_ticks, 2, 0);
+    }
+    if(alarm_on && !ToneBusy()) {
+        ToneStart(alarm_notes, alarm_ticks, 5, 1);
+    }
+}
+
+/**
+  * @brief  Event log task, the lowest priority. Retries a calibration save
+  *         that found the EEPROM busy, otherwise writes the event log to
+  *         EEPROM in batches.
+  * @return Nothing
+  */
+void LogTask (void)
+{
+    if(save_pending) {
+        SaveTask();
+        return;
+    }
+    if(log_age < LOG_AGE_MAX) {
+        log_age++;
+    }
+    if(LogFlush(log_age >= LOG_AGE_MAX)) {
+        log_age = 0;
+    }
+}
+
+#ifdef PULSE_TIMING
+/**
+  * @brief  Pulse task. Adds the air timed from the sensor edges since the
+  *         last tick.
+  * @return Nothing
+  */
+void PulseTask (void)
+{
+    uint32_t us = PulseTake();
+
+    if(us) {
+        /* Split so a backlog of ticks can not overflow */
+        AirAdd(0, (us / 1000) * AIR_PER_MS_Q16 +
+               (us % 1000) * AIR_PER_MS_Q16 / 1000);
+    }
+}
+#endif
+
+#ifdef PROFILE
+/**
+  * @brief  Profile task. Sends the profiling counters once PROFILE_TICKS
+  *         have passed, retrying each tick until the serial output is free.
+  * @return Nothing
+  */
+void ProfileTask (void)
+{
+    if(profile_age < PROFILE_TICKS) {
+        profile_age++;
+    } else if(TelemetryProfile(uptime)) {
+        profile_age = 0;
+    }
+}
+#endif
+
+/* Cooperative task table, run in order on every tick */
+task_t tasks[] = {
+    {SenseTask,  1,                1},
+#ifdef PULSE_TIMING
+    {PulseTask,  1,                1},
+#endif
+    {AirTask,    AIR_BUCKET_TICKS, AIR_BUCKET_TICKS},
+    {SaveTask,   SAVE_TICKS,       SAVE_TICKS},
+    {SwitchTask, 1,                1},
+    {StatusTask, 1,                1},
+    {AlarmTask,  1,                1},
+    {LogTask,    LOG_TICKS,        LOG_TICKS},
+#ifdef PROFILE
+    {ProfileTask, 1,               1},
+#endif
+};
+#define NUM_TASKS       (sizeof(tasks) / sizeof(tasks[0]))
+
+/**
+  * @brief  Runs every task that is due on this tick.
+  * @return Nothing
+  */
+void RunTasks (void)
+{
+    uint8_t i;
+
+    uptime++;
+    for(i = 0; i < NUM_TASKS; i++) {
+        if(--tasks[i].count == 0) {
+            tasks[i].count = tasks[i].period;
+            tasks[i].run();
+        }
+    }
+}
+
+#ifdef SWEEP
+int DetectorMain (void)
+#else
+int main (void)
+#endif
+{
+    calib_t calib;
+    uint8_t ticks, ch;
+
+    HALInit();
+    ADCInit();
+    TickInit();
+#ifdef TELEMETRY
+    TelemetryInit();
+#endif
+#ifdef ADC_STROBE
+    StrobeInit(sample_ticks);
+#endif
+
+    /* Start sampling straight away with the stored calibration, only
+     * calibrating from the first reading on channels the EEPROM holds no
+     * water value for */
+    calibrate = ALL_CHANNELS;
+    if(CalibLoad(&calib) && calib.thresh > 0 && calib.thresh < 10) {
+        thresh_tenths = calib.thresh;
+        thresh_q8 = TENTHS_Q8(calib.thresh);
+        for(ch = 0; ch < ADC_CHANNELS; ch++) {
+            if(calib.water_value[ch] <= ADC_MAX) {
+                SetWaterValue(ch, calib.water_value[ch]);
+#ifdef MEDIAN_FILT
+                MedianFiltFill(ch, calib.water_value[ch]);
+#endif
+#ifdef AVG_FILT
+                AvgFiltFill(ch, calib.water_value[ch]);
+#endif
+                calibrate &= ~(1 << ch);
+            }
+        }
+        air_lifetime = calib.air_total;
+    }
+    LogInit();
+    LogEvent(LOG_BOOT, 0, water_value[0]);
+    IntInit();
+
+    while(1) {
+        /* Catch up on every tick that has elapsed, so a long task delays the
+         * others but never shifts the sample period */
+        ticks = TickWait();
+        /* Race through the due tasks at the fast clock and drop back to
+         * the idle clock to sleep, which costs less per tick than running
+         * them at the idle clock */
+        ClockSet(CLOCK_FAST);
+        while(ticks--) {
+            RunTasks();
+        }
+        ClockSet(CLOCK_IDLE);
+    }
+    return 0;
+}
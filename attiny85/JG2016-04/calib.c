@@ -0,0 +1,103 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/calib.c
+  * @brief   Wear levelled calibration store. Each save goes to the slot after
+  *          the newest one with the next sequence number, so the newest
+  *          record is the one whose successor does not continue the
+  *          sequence. A CRC rejects erased slots and interrupted writes.
+  ******************************************************************************
+  */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hal.h"
+#include "calib.h"
+
+/* Layout of one slot in EEPROM */
+typedef struct {
+    uint8_t seq;
+    calib_t calib;
+    uint8_t crc;
+} calib_record_t;
+
+#define CALIB_SLOTS     (CALIB_EEPROM_SIZE / sizeof(calib_record_t))
+/* Sequence number after s. 0xFF marks an erased slot, so it is skipped */
+#define NEXT_SEQ(s)     ((uint8_t)((s) + 1) == 0xFF ? 0 : (uint8_t)((s) + 1))
+
+/* Newest slot and its sequence number, CALIB_SLOTS - 1 before the first save
+ * so the first record lands in slot 0 */
+uint8_t calib_slot = CALIB_SLOTS - 1;
+uint8_t calib_seq = 0xFF;
+/* Record being written, must stay put until the EEPROM write is done */
+calib_record_t calib_record;
+
+/**
+  * @brief  CRC-8 (polynomial 0x07) over a record, not including the CRC byte
+  * @param  record - record to check
+  * @return CRC of the record
+  */
+uint8_t CalibCRC (const calib_record_t *record)
+{
+    const uint8_t *data = (const uint8_t *)record;
+    uint8_t crc = 0, i, bit;
+
+    for(i = 0; i < offsetof(calib_record_t, crc); i++) {
+        crc ^= data[i];
+        for(bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/**
+  * @brief  Reads a slot and checks its CRC
+  * @param  slot - slot number
+  * @param  record - filled with the slot contents
+  * @return 1 if the slot holds a valid record
+  */
+uint8_t CalibRead (uint8_t slot, calib_record_t *record)
+{
+    EEPROMRead(slot * sizeof(calib_record_t), record, sizeof(calib_record_t));
+    /* An erased slot reads 0xFF, which would pass a CRC of 0xFF data */
+    return record->seq != 0xFF && record->crc == CalibCRC(record);
+}
+
+uint8_t CalibLoad (calib_t *calib)
+{
+    calib_record_t record, next;
+    uint8_t slot, valid, next_valid;
+
+    next_valid = CalibRead(0, &next);
+    for(slot = 0; slot < CALIB_SLOTS; slot++) {
+        record = next;
+        valid = next_valid;
+        next_valid = CalibRead(slot + 1 == CALIB_SLOTS ? 0 : slot + 1, &next);
+        /* The newest record is not followed by its successor */
+        if(valid && (!next_valid || next.seq != NEXT_SEQ(record.seq))) {
+            calib_slot = slot;
+            calib_seq = record.seq;
+            *calib = record.calib;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t CalibSave (const calib_t *calib)
+{
+    if(EEPROMBusy()) {
+        return 0;
+    }
+    if(++calib_slot == CALIB_SLOTS) {
+        calib_slot = 0;
+    }
+    calib_seq = NEXT_SEQ(calib_seq);
+    calib_record.seq = calib_seq;
+    calib_record.calib = *calib;
+    calib_record.crc = CalibCRC(&calib_record);
+    EEPROMWrite(calib_slot * sizeof(calib_record_t), &calib_record,
+                sizeof(calib_record_t));
+    return 1;
+}
@@ -0,0 +1,42 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/calib.h
+  * @brief   Calibration kept in EEPROM across power cycles. Records are
+  *          written round a ring of slots at the bottom of the EEPROM so
+  *          each cell only sees a fraction of the writes.
+  ******************************************************************************
+  */
+
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stdint.h>
+
+#include "hal.h"
+
+/* EEPROM bytes from address 0 used by the ring, the event log has the rest */
+#define CALIB_EEPROM_SIZE   128
+
+/* Calibration and totals restored at boot */
+typedef struct {
+    uint16_t water_value[ADC_CHANNELS]; /* reading with water in the line */
+    uint8_t thresh;         /* bubble threshold in tenths of water_value */
+    uint32_t air_total;     /* uL of air seen over the life of the unit */
+} calib_t;
+
+/**
+  * @brief  Finds the newest valid record in the ring
+  * @param  calib - filled with the stored calibration
+  * @return 1 if a valid record was found, 0 if the EEPROM holds none
+  */
+uint8_t CalibLoad (calib_t *calib);
+
+/**
+  * @brief  Writes the calibration to the next slot of the ring. The write
+  *         runs in the background, see EEPROMWrite.
+  * @param  calib - calibration to store
+  * @return 1 if the write was started, 0 if the EEPROM was still busy
+  */
+uint8_t CalibSave (const calib_t *calib);
+
+#endif /* CALIB_H */
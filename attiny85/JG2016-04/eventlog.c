@@ -0,0 +1,327 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/eventlog.c
+  * @brief   Bubble event log. Each record is a header byte holding the event
+  *          type and a repeat count, then the time since the previous event
+  *          and the event argument as varints (7 bits per byte, low bits
+  *          first, top bit set on all but the last byte). A record with a
+  *          repeat count of n stands for n events spaced by its delta.
+  *
+  *          The EEPROM above the calibration ring is split into pages. The
+  *          first byte of a page is a sequence number and the records follow,
+  *          with 0xFF after the last one. A new page is written with its
+  *          sequence byte still 0xFF and only marked valid once its records
+  *          are in, so an interrupted write never shows stale records.
+  ******************************************************************************
+  */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hal.h"
+#include "calib.h"
+#include "eventlog.h"
+
+#define LOG_EEPROM_ADDR CALIB_EEPROM_SIZE
+#define LOG_PAGE_SIZE   32
+#define LOG_PAGES       ((EEPROM_SIZE - LOG_EEPROM_ADDR) / LOG_PAGE_SIZE)
+/* SRAM buffer, and the buffered bytes that make a batch worth writing */
+#define LOG_BUF_SIZE    32
+#define LOG_BATCH       16
+/* Header, 5 byte delta and 3 byte argument */
+#define LOG_RECORD_MAX  9
+
+/* Record header, count is 1 to LOG_MAX_COUNT. Type 7 is never used so a
+ * header can not read as erased EEPROM */
+#define LOG_HEADER(type)    ((uint8_t)((type) << 5))
+#define LOG_TYPE(header)    ((header) >> 5)
+#define LOG_COUNT(header)   (((header) & 0x1F) + 1)
+#define LOG_MAX_COUNT       32
+#define LOG_ERASED          0xFF
+/* log_last when the last record can not take repeats */
+#define LOG_NONE            0xFF
+/* Sequence number after s. 0xFF marks an erased page, so it is skipped */
+#define NEXT_SEQ(s)     ((uint8_t)((s) + 1) == 0xFF ? 0 : (uint8_t)((s) + 1))
+
+#if LOG_PAGES < 2
+#error "The event log needs at least two EEPROM pages"
+#endif
+
+/* Records waiting to be written to EEPROM */
+uint8_t log_buf[LOG_BUF_SIZE];
+uint8_t log_len;
+/* Start of the last record in log_buf and what it holds, for run-length
+ * encoding. Records already moved to the page are not extended */
+uint8_t log_last = LOG_NONE;
+uint8_t log_last_type;
+uint32_t log_last_delta;
+uint16_t log_last_arg;
+/* Time of the last logged event in log units */
+uint32_t log_time;
+
+/* Image of the current EEPROM page, only changed while the EEPROM is idle */
+uint8_t log_page[LOG_PAGE_SIZE];
+uint8_t log_pos;
+uint8_t log_slot = LOG_PAGES - 1;
+uint8_t log_seq = 0xFF;
+/* Set once the current page has been written at least once */
+uint8_t log_written;
+
+/**
+  * @brief  Encodes a value as a varint
+  * @param  data - buffer for up to 5 bytes
+  * @param  value - value to encode
+  * @return Number of bytes written
+  */
+uint8_t LogPutVarint (uint8_t *data, uint32_t value)
+{
+    uint8_t len = 0;
+
+    while(value > 0x7F) {
+        data[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    data[len++] = value;
+    return len;
+}
+
+/**
+  * @brief  Decodes a varint
+  * @param  data - encoded value
+  * @param  max - bytes available
+  * @param  value - decoded value
+  * @return Number of bytes read, 0 if the varint runs past max
+  */
+uint8_t LogGetVarint (const uint8_t *data, uint8_t max, uint32_t *value)
+{
+    uint8_t len = 0, shift = 0;
+
+    *value = 0;
+    while(len < max && shift < 32) {
+        *value |= (uint32_t)(data[len] & 0x7F) << shift;
+        if(!(data[len++] & 0x80)) {
+            return len;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+/**
+  * @brief  Decodes the record at data
+  * @param  data - start of the record
+  * @param  max - bytes available
+  * @param  delta - time since the previous event in log units
+  * @param  arg - event argument
+  * @return Length of the record, 0 at the end of the records
+  */
+uint8_t LogRecord (const uint8_t *data, uint8_t max, uint32_t *delta,
+                   uint32_t *arg)
+{
+    uint8_t len, n;
+
+    if(max == 0 || data[0] == LOG_ERASED) {
+        return 0;
+    }
+    len = 1;
+    n = LogGetVarint(&data[len], max - len, delta);
+    if(n == 0) {
+        return 0;
+    }
+    len += n;
+    n = LogGetVarint(&data[len], max - len, arg);
+    if(n == 0) {
+        return 0;
+    }
+    return len + n;
+}
+
+/**
+  * @brief  Reads a page of the log
+  * @param  slot - page number
+  * @param  page - filled with the page contents
+  * @return Nothing
+  */
+void LogReadPage (uint8_t slot, uint8_t *page)
+{
+    EEPROMRead(LOG_EEPROM_ADDR + slot * LOG_PAGE_SIZE, page, LOG_PAGE_SIZE);
+}
+
+/**
+  * @brief  Finds the newest page, the valid page not followed by its
+  *         successor
+  * @param  seq - sequence number of the newest page
+  * @return Newest page, LOG_NONE if no page is valid
+  */
+uint8_t LogNewest (uint8_t *seq)
+{
+    uint8_t slot, next;
+
+    EEPROMRead(LOG_EEPROM_ADDR, &next, 1);
+    for(slot = 0; slot < LOG_PAGES; slot++) {
+        *seq = next;
+        EEPROMRead(LOG_EEPROM_ADDR + (slot + 1 == LOG_PAGES ? 0 : slot + 1) *
+                   LOG_PAGE_SIZE, &next, 1);
+        if(*seq != LOG_ERASED && next != NEXT_SEQ(*seq)) {
+            return slot;
+        }
+    }
+    return LOG_NONE;
+}
+
+/**
+  * @brief  Starts an empty page after the current one
+  * @return Nothing
+  */
+void LogNewPage (void)
+{
+    if(++log_slot == LOG_PAGES) {
+        log_slot = 0;
+    }
+    log_seq = NEXT_SEQ(log_seq);
+    memset(log_page, LOG_ERASED, LOG_PAGE_SIZE);
+    log_pos = 1;
+    log_written = 0;
+}
+
+void LogInit (void)
+{
+    uint32_t delta, arg;
+    uint8_t slot, len;
+
+    slot = LogNewest(&log_seq);
+    if(slot == LOG_NONE) {
+        log_seq = 0xFF;
+        LogNewPage();
+        return;
+    }
+    log_slot = slot;
+    LogReadPage(slot, log_page);
+    log_pos = 1;
+    while((len = LogRecord(&log_page[log_pos], LOG_PAGE_SIZE - log_pos,
+                           &delta, &arg))) {
+        log_pos += len;
+    }
+    /* Clear anything left by an interrupted write with the next flush */
+    memset(&log_page[log_pos], LOG_ERASED, LOG_PAGE_SIZE - log_pos);
+    log_written = 1;
+}
+
+uint32_t LogUnits (uint32_t ticks)
+{
+#if LOG_UNIT_MS % TICK_MS == 0
+    return ticks / (LOG_UNIT_MS / TICK_MS);
+#else
+    /* Split so ticks * TICK_MS can not overflow */
+    return ticks / LOG_UNIT_MS * TICK_MS +
+           ticks % LOG_UNIT_MS * TICK_MS / LOG_UNIT_MS;
+#endif
+}
+
+void LogEvent (uint8_t type, uint32_t time, uint16_t arg)
+{
+    uint8_t record[LOG_RECORD_MAX];
+    uint32_t units = LogUnits(time);
+    uint32_t delta = units - log_time;
+    uint8_t len;
+
+    if(log_last != LOG_NONE && type == log_last_type &&
+            delta == log_last_delta && arg == log_last_arg &&
+            LOG_COUNT(log_buf[log_last]) < LOG_MAX_COUNT) {
+        /* Another of the same event at the same spacing */
+        log_buf[log_last]++;
+        log_time = units;
+        return;
+    }
+
+    record[0] = LOG_HEADER(type);
+    len = 1;
+    len += LogPutVarint(&record[len], delta);
+    len += LogPutVarint(&record[len], arg);
+    if(log_len + len > LOG_BUF_SIZE) {
+        return;
+    }
+    memcpy(&log_buf[log_len], record, len);
+    log_last = log_len;
+    log_len += len;
+    log_last_type = type;
+    log_last_delta = delta;
+    log_last_arg = arg;
+    log_time = units;
+}
+
+uint8_t LogFlush (uint8_t force)
+{
+    uint32_t delta, arg;
+    uint8_t len, moved = 0;
+
+    if(EEPROMBusy()) {
+        return 0;
+    }
+    if(log_written && log_page[0] == LOG_ERASED) {
+        /* The records of a new page are in, mark it valid */
+        log_page[0] = log_seq;
+    } else {
+        if(log_len == 0 || (!force && log_len < LOG_BATCH)) {
+            return 0;
+        }
+        len = LogRecord(log_buf, log_len, &delta, &arg);
+        if(log_pos + len > LOG_PAGE_SIZE) {
+            /* The current page is full and has been written */
+            LogNewPage();
+        }
+        /* Move whole records while they fit on the page */
+        while(moved < log_len &&
+                (len = LogRecord(&log_buf[moved], log_len - moved,
+                                 &delta, &arg)) &&
+                log_pos + len <= LOG_PAGE_SIZE) {
+            memcpy(&log_page[log_pos], &log_buf[moved], len);
+            log_pos += len;
+            moved += len;
+        }
+        log_len -= moved;
+        memmove(log_buf, &log_buf[moved], log_len);
+        if(log_last != LOG_NONE) {
+            log_last = log_last >= moved ? log_last - moved : LOG_NONE;
+        }
+    }
+
+    EEPROMWrite(LOG_EEPROM_ADDR + log_slot * LOG_PAGE_SIZE, log_page,
+                LOG_PAGE_SIZE);
+    log_written = 1;
+    return 1;
+}
+
+#ifndef __AVR__
+void LogDump (void (*event)(uint8_t type, uint32_t time, uint16_t arg))
+{
+    uint8_t page[LOG_PAGE_SIZE];
+    uint32_t time = 0, delta, arg;
+    uint8_t newest, seq, slot, pos, len, count, i;
+
+    newest = LogNewest(&seq);
+    if(newest == LOG_NONE) {
+        return;
+    }
+    /* The page after the newest is the oldest once the ring has wrapped */
+    for(i = 1; i <= LOG_PAGES; i++) {
+        slot = (newest + i) % LOG_PAGES;
+        LogReadPage(slot, page);
+        if(page[0] == LOG_ERASED) {
+            continue;
+        }
+        pos = 1;
+        while((len = LogRecord(&page[pos], LOG_PAGE_SIZE - pos,
+                               &delta, &arg))) {
+            if(LOG_TYPE(page[pos]) == LOG_BOOT) {
+                time = 0;
+            }
+            for(count = LOG_COUNT(page[pos]); count; count--) {
+                time += delta;
+                event(LOG_TYPE(page[pos]), time * LOG_UNIT_MS, arg);
+            }
+            pos += len;
+        }
+    }
+}
+#endif
@@ -0,0 +1,84 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/eventlog.h
+  * @brief   Bubble event log. Events are packed into a small SRAM buffer as
+  *          run-length encoded records with delta timestamps and flushed in
+  *          batches to a ring of pages in the EEPROM above the calibration
+  *          ring, so an incident can be read back after the fact.
+  ******************************************************************************
+  */
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+
+/* Event types, the top 3 bits of a record header. The args of bubble,
+ * calibration and alarm events carry the sensor channel, see LOG_CH */
+#define LOG_BOOT        0   /* arg: water value restored at boot, 0 if none */
+#define LOG_BUBBLE      1   /* arg: bubble duration in log units */
+#define LOG_CAL         2   /* arg: water value from a full calibration */
+#define LOG_RECAL       3   /* arg: tracked water value after drifting 1/32 */
+#define LOG_ALARM       4   /* arg: uL of air in the channel's window */
+#define LOG_COMP        5   /* arg: bandgap level, water is out of its range */
+
+/* Packs a channel into the top 2 bits of an event arg, the value saturates
+ * at LOG_ARG_MAX */
+#define LOG_ARG_MAX     0x3FFF
+#define LOG_CH(ch, arg) ((uint16_t)((uint16_t)(ch) << 14 | \
+                        ((arg) > LOG_ARG_MAX ? LOG_ARG_MAX : (arg))))
+#define LOG_ARG_CH(arg) ((arg) >> 14)
+#define LOG_ARG_VALUE(arg) ((arg) & LOG_ARG_MAX)
+
+/* Timestamps and bubble durations are kept in units of LOG_UNIT_MS, the
+ * default sample period, whatever TICK_MS the firmware was built with */
+#define LOG_UNIT_MS     50
+
+/**
+  * @brief  Converts a time in ticks to log units, rounding down
+  * @param  ticks - time in ticks
+  * @return Time in units of LOG_UNIT_MS
+  */
+uint32_t LogUnits (uint32_t ticks);
+
+/**
+  * @brief  Finds the newest page of the log in EEPROM and carries on
+  *         appending to it, or starts the first page of an empty log
+  * @return Nothing
+  */
+void LogInit (void);
+
+/**
+  * @brief  Adds an event to the SRAM log. An event with the same type,
+  *         argument and spacing as the last record only bumps that record's
+  *         repeat count. Events are dropped while the buffer is full.
+  * @param  type - one of the LOG_ event types
+  * @param  time - ticks since boot
+  * @param  arg - event argument, see the event types
+  * @return Nothing
+  */
+void LogEvent (uint8_t type, uint32_t time, uint16_t arg);
+
+/**
+  * @brief  Moves buffered records to the current EEPROM page and starts a
+  *         background write of the page. Only writes once enough records
+  *         have built up, unless forced.
+  * @param  force - non-zero to write any buffered records
+  * @return 1 if a write was started, 0 if there was nothing to write or the
+  *         EEPROM was busy
+  */
+uint8_t LogFlush (uint8_t force);
+
+#ifndef __AVR__
+/**
+  * @brief  Host only. Replays the log in EEPROM from the oldest page to the
+  *         newest, one call per event. Times restart at each LOG_BOOT, and
+  *         events before the first boot record are timed from the start of
+  *         the oldest page.
+  * @param  event - called with the type, ms since boot and argument
+  * @return Nothing
+  */
+void LogDump (void (*event)(uint8_t type, uint32_t time, uint16_t arg));
+#endif
+
+#endif /* EVENTLOG_H */
@@ -0,0 +1,340 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/hal.h
+  * @brief   Hardware abstraction layer for the JG2016-04 bubble detector.
+  *          hal_avr.c drives the ATtiny85, hal_host.c replays recorded ADC
+  *          samples on Linux so the detection logic can run off-target.
+  ******************************************************************************
+  */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+/* Scheduler tick period. With -DPOWER_DOWN the tick is the watchdog
+ * interrupt, nominally 16ms but +-10% with supply and temperature, so the
+ * core can power down between ticks */
+#ifdef POWER_DOWN
+#define TICK_MS         16
+#else
+#define TICK_MS         5
+#endif
+/* Bytes of EEPROM on the ATtiny85 */
+#define EEPROM_SIZE     512
+/* Sensor inputs scanned each sample period: channel 0 is ADC1 (PB2) and
+ * channel 1 is ADC3 (PB3), which takes the place of the switch */
+#ifndef ADC_CHANNELS
+#define ADC_CHANNELS    1
+#endif
+#if ADC_CHANNELS < 1 || ADC_CHANNELS > 2
+#error "ADC_CHANNELS must be 1 or 2, the other ADC pins are in use"
+#endif
+/* Extra bits of resolution from oversampling: each reading is the sum of
+ * 4^OVERSAMPLE_BITS conversions shifted right by OVERSAMPLE_BITS. Needs at
+ * least 1 LSB of noise on the input to gain anything */
+#ifndef OVERSAMPLE_BITS
+#define OVERSAMPLE_BITS 0
+#endif
+#if OVERSAMPLE_BITS < 0 || OVERSAMPLE_BITS > 2
+#error "OVERSAMPLE_BITS must be 0 to 2"
+#endif
+#define ADC_OVERSAMPLE  (1 << (2 * OVERSAMPLE_BITS))
+#define ADC_BITS        (10 + OVERSAMPLE_BITS)
+#define ADC_MAX         ((1 << ADC_BITS) - 1)
+
+// Interrupt counter for switch, set by the HAL when PB3 changes
+extern volatile uint8_t timer_flag;
+
+/**
+  * @brief  Sets the clock prescaler and the GPIO directions
+  * @return Nothing
+  */
+void HALInit (void);
+
+/* Core clock profiles for ClockSet */
+#define CLOCK_IDLE      0
+#define CLOCK_FAST      1
+
+/**
+  * @brief  Switches the core clock profile. The tick, tone, serial bit rate
+  *         and ADC clock do not change, so work can race through a burst at
+  *         CLOCK_FAST and drop back to CLOCK_IDLE before sleeping. The timer
+  *         prescaler phase is not kept across a switch, so a tick can move
+  *         by up to one Timer0 count, but the errors cancel on average and
+  *         do not add up to drift.
+  * @param  profile - CLOCK_IDLE (F_CPU) or CLOCK_FAST (F_FAST)
+  * @return Nothing
+  */
+void ClockSet (uint8_t profile);
+
+/**
+  * @brief  ADC initialisation. Selects ADC1 (PB2) against the 1V1 reference.
+  * @return Nothing
+  */
+void ADCInit (void);
+
+/**
+  * @brief  Powers the ADC up for a sample window or back down after it. The
+  *         first conversion after power up takes twice as long.
+  * @param  on - non-zero to power up
+  * @return Nothing
+  */
+void ADCPower (uint8_t on);
+
+/**
+ * @brief Retrieves a reading from the selected sensor input
+ * @return ADC_BITS bit digital value
+ */
+uint16_t ADCGet (void);
+
+/**
+  * @brief  Selects the input for the following ADCGet calls. Selecting the
+  *         next channel straight after a conversion lets the input settle
+  *         while other work runs.
+  * @param  channel - sensor channel, 0 to ADC_CHANNELS - 1
+  * @return Nothing
+  */
+void ADCSelect (uint8_t channel);
+
+#ifdef COMP_WAKE
+/* Comparator wake, built with -DCOMP_WAKE. The analog comparator watches
+ * channel 0 through the ADC mux against the bandgap, and the ADC reads
+ * against VCC so the two can be compared. Readings are then in VCC counts,
+ * e.g. 1.2V reads 372 at 3.3V where the 1V1 reference reads it as full
+ * scale, and the sensor needs a front end that puts water above the
+ * bandgap, see COMP_WAKE in JG2016-04.c */
+
+/**
+  * @brief  Measures the bandgap with the ADC, the level the comparator trips
+  *         below. The ADC must be powered.
+  * @return Bandgap in ADC_BITS counts against VCC
+  */
+uint16_t CompLevel (void);
+
+/**
+  * @brief  Starts or stops the comparator watching channel 0. The ADC must
+  *         be powered down first, and powered up again after stopping.
+  * @param  on - non-zero to start
+  * @return Nothing
+  */
+void CompArm (uint8_t on);
+
+/**
+  * @brief  Checks if the sensor has gone below the level since CompArm,
+  *         latched by the comparator interrupt within microseconds
+  * @return Non-zero once tripped
+  */
+uint8_t CompTripped (void);
+
+/**
+  * @brief  Checks if the sensor is below the level now, unlike CompTripped
+  *         which stays set once it has been
+  * @return Non-zero while below
+  */
+uint8_t CompBelow (void);
+#endif
+
+#ifdef PULSE_TIMING
+/* Pulse timing, built with -DPULSE_TIMING. The sensor edges are stamped
+ * from the tick timer as they happen, by the comparator while CompArm has
+ * it on, so air is timed to a timer count (64us at 125kHz) instead of a
+ * sample period. The comparator edges are where the sensor crosses the
+ * bandgap level, which sits between the bubble threshold and the water
+ * value */
+
+/**
+  * @brief  Takes the air time since the last call, including the part of
+  *         a bubble still in progress
+  * @return Air time in us
+  */
+uint32_t PulseTake (void);
+#endif
+
+/**
+  * @brief  Interrupt initialisation. Enables the switch interrupt on PB3 and
+  *         global interrupts.
+  * @return Nothing
+  */
+void IntInit (void);
+
+/**
+  * @brief  Starts the scheduler tick, every TICK_MS
+  * @return Nothing
+  */
+void TickInit (void);
+
+#ifdef ADC_STROBE
+/**
+  * @brief  Starts timer triggered sampling. At the start of every period the
+  *         sensor LED is turned on and the ADC is triggered after a fixed
+  *         settling delay. The LED goes off when that conversion completes
+  *         and a dark reading is taken half a period later. ADCGet can not
+  *         be used in this mode.
+  * @param  period - sample period in ticks
+  * @return Nothing
+  */
+void StrobeInit (uint8_t period);
+
+/**
+  * @brief  Collects the latest pair of readings from the strobe
+  * @param  on_value - reading with the sensor LED on
+  * @param  off_value - dark reading from the same period
+  * @return 1 if a new pair was collected, 0 otherwise
+  */
+uint8_t StrobeGet (uint16_t *on_value, uint16_t *off_value);
+#endif
+
+/**
+  * @brief  Sleeps until at least one tick has elapsed
+  * @return Number of ticks elapsed since the last call
+  */
+uint8_t TickWait (void);
+
+/**
+  * @brief  Reads the switch on PB3
+  * @return Non-zero while the switch is on (high), always 0 when PB3 is
+  *         scanned as a second sensor
+  */
+uint8_t SwitchRead (void);
+
+/**
+  * @brief  Reads a block from EEPROM, waiting for any write to finish first
+  * @param  addr - EEPROM address
+  * @param  data - buffer to read into
+  * @param  len - number of bytes
+  * @return Nothing
+  */
+void EEPROMRead (uint16_t addr, void *data, uint8_t len);
+
+/**
+  * @brief  Starts writing a block to EEPROM in the background, one byte per
+  *         EEPROM ready interrupt. Bytes that already hold the value are
+  *         skipped. data must not change until EEPROMBusy returns 0.
+  * @param  addr - EEPROM address
+  * @param  data - bytes to write
+  * @param  len - number of bytes
+  * @return Nothing
+  */
+void EEPROMWrite (uint16_t addr, const void *data, uint8_t len);
+
+/**
+  * @brief  Checks if a background EEPROM write is still running
+  * @return Non-zero while writing
+  */
+uint8_t EEPROMBusy (void);
+
+#ifdef PROFILE
+/* Interrupts timed by the profiling counters */
+#define PROF_TICK       0   /* tick timer compare match */
+#define PROF_PCINT      1   /* PCINT0_vect, the switch */
+#define PROF_ADC        2   /* ADC_vect */
+#define PROF_EEPROM     3   /* EE_RDY_vect */
+#define PROF_USI        4   /* USI_OVF_vect, the serial output */
+#define PROF_ISRS       5
+
+/* Profiling counters, built with -DPROFILE. Times are in counts of the
+ * tick timer, count_us each, so they cost two timer reads to take */
+typedef struct {
+    uint16_t count_us;      /* timer count length, 0 if not timed */
+    uint32_t ticks;         /* ticks the counters cover */
+    uint32_t awake;         /* counts from each wake to the next sleep */
+    uint16_t awake_max;     /* longest single wake, the worst main loop */
+    uint32_t conversions;   /* ADC conversions */
+    uint16_t isr_calls[PROF_ISRS];
+    uint32_t isr_counts[PROF_ISRS];
+} profile_t;
+
+/**
+  * @brief  Reads the profiling counters and starts them again from 0
+  * @param  prof - filled with the counters since the previous call
+  * @return Nothing
+  */
+void ProfileGet (profile_t *prof);
+#endif
+
+#ifdef TELEMETRY
+/* UART style serial output on PB1 (USI DO), 8 data bits, no parity, one
+ * stop bit. PB1 is the buzzer output otherwise, so tones are silent in
+ * this build */
+#define SERIAL_BAUD     2400
+#define SERIAL_BUF_SIZE 64
+
+/**
+  * @brief  Starts the serial output. The line idles high.
+  * @return Nothing
+  */
+void SerialInit (void);
+
+/**
+  * @brief  Checks how many bytes SerialPut can queue
+  * @return Free space in the transmit buffer
+  */
+uint8_t SerialFree (void);
+
+/**
+  * @brief  Queues a byte to be sent in the background. The caller must
+  *         check SerialFree first.
+  * @param  data - byte to send
+  * @return Nothing
+  */
+void SerialPut (uint8_t data);
+#endif
+
+/**
+  * @brief  Turns the sensor LED on PB4 on or off
+  * @param  on - non-zero to turn the LED on
+  * @return Nothing
+  */
+void SensorLED (uint8_t on);
+
+/**
+  * @brief  Waits for the sensor LED to settle, for sample windows shorter
+  *         than a tick. Runs at the idle clock whatever the profile.
+  * @return Nothing
+  */
+void SensorSettle (void);
+
+/**
+  * @brief  Turns the status LED on PB0 on or off
+  * @param  on - non-zero to turn the LED on
+  * @return Nothing
+  */
+void StatusLED (uint8_t on);
+
+/**
+  * @brief  Starts playing a sequence of notes on PB1 in the background. The
+  *         sequence is stepped by the tick interrupt, so this returns at once.
+  * @param  notes - Timer1 OCR value for each note, 0 for a rest
+  * @param  ticks - duration of each note in ticks
+  * @param  length - number of notes in the sequence
+  * @param  loop - non-zero to repeat the sequence until ToneStop
+  * @return Nothing
+  */
+void ToneStart (const uint8_t *notes, const uint8_t *ticks, uint8_t length,
+                uint8_t loop);
+
+/**
+  * @brief  Stops the tone sequence and silences PB1
+  * @return Nothing
+  */
+void ToneStop (void);
+
+/**
+  * @brief  Checks if a tone sequence is playing
+  * @return Non-zero while a sequence is playing
+  */
+uint8_t ToneBusy (void);
+
+#ifndef __AVR__
+/**
+  * @brief  Host backend only. Supplies ADC readings from a callback instead
+  *         of HAL_ADC_FILE. Must be called before HALInit.
+  * @param  source - callback that writes the next reading to *value and
+  *         returns 0 once there are no more samples
+  * @return Nothing
+  */
+void HALSetADCSource (int (*source)(uint16_t *value));
+#endif
+
+#endif /* HAL_H */
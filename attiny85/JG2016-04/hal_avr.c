@@ -0,0 +1,1274 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/hal_avr.c
+  * @brief   ATtiny85 backend of the JG2016-04 hardware abstraction layer
+  ******************************************************************************
+  */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sfr_defs.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+#include <util/delay.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tiny85.h"
+#include "hal.h"
+
+/*
+ * Clock profiles, all from the Makefile. The core runs at F_CPU, the F_OSC
+ * oscillator divided down by CLKPR, and every timer, prescaler and count
+ * below is derived for it. ClockSet(CLOCK_FAST) raises the core to F_FAST
+ * and multiplies each peripheral prescaler by CLOCK_RATIO so the tick, tone,
+ * bit rate and ADC clock stay the same.
+ */
+#if !defined(F_OSC) || !defined(F_CPU) || !defined(F_FAST)
+#error "F_OSC, F_CPU and F_FAST are set by the Makefile"
+#endif
+/* CLKPR prescaler select for each profile */
+#define CLK_IDLE_PS     LOG2(F_OSC / F_CPU)
+#define CLK_FAST_PS     LOG2(F_OSC / F_FAST)
+#if F_FAST < F_CPU || F_OSC / F_CPU > 256 || \
+    (F_OSC >> CLK_IDLE_PS) != F_CPU || (F_OSC >> CLK_FAST_PS) != F_FAST
+#error "F_CPU and F_FAST must be F_OSC divided by a power of 2 up to 256"
+#endif
+#define CLOCK_RATIO     (F_FAST / F_CPU)
+#define CLOCK_SHIFT     (CLK_IDLE_PS - CLK_FAST_PS)
+
+/* Convert in ADC noise reduction sleep instead of spinning on ADSC.
+ * Comment out to busy wait. Not used with the timer triggered strobe, which
+ * needs Timer0 running during the conversion */
+#ifndef ADC_STROBE
+#define ADC_SLEEP
+#endif
+/* Noise reduction sleep stops clk_IO and with it Timer0. A single
+ * conversion holds the tick back by ~0.2ms a sample, but an oversampling
+ * burst (~3.5ms at OVERSAMPLE_BITS=2) would stretch every sample period,
+ * the serial bit being sent or a pulse being timed. Those sleep in idle
+ * mode instead and restart each conversion from ADC_vect. The POWER_DOWN
+ * tick comes from the watchdog and keeps running either way */
+#if !defined(POWER_DOWN) && \
+    (ADC_OVERSAMPLE > 1 || defined(TELEMETRY) || defined(PULSE_TIMING))
+#define ADC_SLEEP_IDLE
+#endif
+
+/* Scheduler tick from Timer0 in CTC mode: F_CPU / T0_PRESCALE / (T0_OCR + 1) */
+#define T0_PRESCALE     8
+#define T0_OCR          ((F_CPU / T0_PRESCALE) * TICK_MS / 1000 - 1)
+
+/* ADC clock F_CPU / 2, 62.5kHz at 125kHz */
+#define ADC_PS_IDLE     1
+#if ADC_PS_IDLE + CLOCK_SHIFT > 7
+#error "No ADC prescaler for this CLOCK_RATIO"
+#endif
+
+#ifdef TELEMETRY
+#ifdef ADC_STROBE
+#error "TELEMETRY and ADC_STROBE both need Timer0"
+#endif
+/* Timer0 clocks the USI at the bit rate, so the tick comes from Timer1 with
+ * the same prescaler and count and the tone is not played */
+#define TICK_vect       TIMER1_COMPA_vect
+#define T0_BAUD_OCR     ((F_CPU + SERIAL_BAUD / 2) / SERIAL_BAUD - 1)
+#if (F_CPU / (T0_BAUD_OCR + 1)) * 50 < SERIAL_BAUD * 49 || \
+    (F_CPU / (T0_BAUD_OCR + 1)) * 50 > SERIAL_BAUD * 51
+#error "SERIAL_BAUD is more than 2% off at this F_CPU"
+#endif
+/* Timer0 prescaler select (CS02:0) for the bit rate when fast, /1 at F_CPU */
+#if CLOCK_SHIFT == 0
+#define T0_FAST_CS      1
+#elif CLOCK_SHIFT == 3
+#define T0_FAST_CS      2
+#elif CLOCK_SHIFT == 6
+#define T0_FAST_CS      3
+#else
+#error "TELEMETRY needs a CLOCK_RATIO of 1, 8 or 64"
+#endif
+/* Timer1 prescaler select (CS13:0) for the tick, /8 at F_CPU */
+#define T1_TICK_CS      (4 + CLOCK_SHIFT)
+#if T1_TICK_CS > 15
+#error "No Timer1 prescaler for this CLOCK_RATIO"
+#endif
+#else
+#define TICK_vect       TIMER0_COMPA_vect
+/* Timer0 prescaler select (CS02:0) for the tick when fast, /8 at F_CPU.
+ * Timer0 has no /512, so at a ratio of 64 it counts half as far at /1024 */
+#if CLOCK_SHIFT == 0 || CLOCK_SHIFT == 3 || CLOCK_SHIFT == 5
+#define T0_FAST_CS      (2 + (CLOCK_SHIFT + 1) / 3)
+#define T0_FAST_SHIFT   0
+#elif CLOCK_SHIFT == 6
+#define T0_FAST_CS      5
+#define T0_FAST_SHIFT   1
+#if (T0_OCR + 1) & 1
+#error "The tick count must be even at this CLOCK_RATIO"
+#endif
+#elif CLOCK_SHIFT == 7
+#define T0_FAST_CS      5
+#define T0_FAST_SHIFT   0
+#else
+#error "No Timer0 prescaler for this CLOCK_RATIO"
+#endif
+#endif
+
+#ifdef POWER_DOWN
+/* The watchdog interrupt is the tick, it keeps running in power-down */
+#if defined(ADC_STROBE) || defined(PROFILE)
+#error "ADC_STROBE and PROFILE need a timer tick, not POWER_DOWN"
+#endif
+#undef TICK_vect
+#define TICK_vect       WDT_vect
+#endif
+
+/* Modules with their clocks gated by HALInit. Timer1 is powered while a tone
+ * plays and the ADC during the sample window, see ADCPower */
+#if defined(TELEMETRY) && defined(POWER_DOWN)
+#define PRR_GATED       (1 << PRTIM1)
+#elif defined(TELEMETRY)
+#define PRR_GATED       0
+#elif defined(POWER_DOWN)
+#define PRR_GATED       ((1 << PRUSI) | (1 << PRTIM1) | (1 << PRTIM0))
+#else
+#define PRR_GATED       ((1 << PRUSI) | (1 << PRTIM1))
+#endif
+/* Sensor LED settling time when it is waited out within a tick */
+#define SENSOR_SETTLE_US 2000
+
+#ifdef PULSE_TIMING
+/* Length of a tick timer count */
+#define PULSE_COUNT_US  (T0_PRESCALE * 1000000UL / F_CPU)
+#if PULSE_COUNT_US * F_CPU != T0_PRESCALE * 1000000UL
+#error "F_CPU must give a whole number of us per Timer0 count"
+#endif
+#endif
+/* Timer0 count at F_CPU / T0_PRESCALE, scaled back up when the fast clock
+ * halves it */
+#define T0_COUNT()      ((uint8_t)(TCNT0 << t0_shift))
+
+#ifdef PROFILE
+/* Length of a tick timer count, and the count and compare match flag of the
+ * tick timer. The count is scaled back up when the fast clock halves it */
+#define PROF_COUNT_US   (T0_PRESCALE * 1000000UL / F_CPU)
+#ifdef TELEMETRY
+#define PROF_COUNT()    TCNT1
+#define PROF_TICK_FLAG  OCF1A
+#else
+#define PROF_COUNT()    T0_COUNT()
+#define PROF_TICK_FLAG  OCF0A
+#endif
+#endif
+
+// Interrupt counter for switch
+volatile uint8_t timer_flag;
+// Number of scheduler ticks that have elapsed but not been run yet
+volatile uint8_t tick_pending;
+
+#ifdef ADC_STROBE
+/* Sensor LED settling time before the triggered conversion. The conversion
+ * starts on Timer0 compare match B, this far into the LED on tick */
+#define STROBE_SETTLE_US 2000
+#define T0_OCRB         ((F_CPU / T0_PRESCALE) * STROBE_SETTLE_US / 1000000UL)
+#if T0_OCRB >= T0_OCR
+#error "STROBE_SETTLE_US must be shorter than a tick"
+#endif
+
+/* Strobe position within the sample period and the last pair of readings */
+uint8_t strobe_period;
+uint8_t strobe_phase;
+volatile uint16_t strobe_on;
+volatile uint16_t strobe_off;
+volatile uint8_t strobe_ready;
+/* Oversampling burst in progress in ADC_vect */
+uint16_t strobe_sum;
+uint8_t strobe_count;
+#endif
+
+/* Timer1 settings to play and stop a tone on PB1 (OC1A), prescaler of 2 at
+ * F_CPU, see tone_cs */
+#define TONE_CS_IDLE    2
+#if TONE_CS_IDLE + CLOCK_SHIFT > 15
+#error "No Timer1 prescaler for this CLOCK_RATIO"
+#endif
+#define TONE_ON         ((1 << CTC1) | (1 << COM1A0) | tone_cs)
+#define TONE_OFF        ((1 << CTC1) | (1 << COM1A0))
+#ifdef TELEMETRY
+#define TONE_NOTE(ocr)
+#define TONE_SILENCE()
+#define TONE_POWER_ON()
+#define TONE_POWER_OFF()
+#else
+#define TONE_NOTE(ocr)  do { OCR1C = (ocr); TCCR1 = TONE_ON; } while(0)
+#define TONE_SILENCE()  (TCCR1 = TONE_OFF)
+#define TONE_POWER_ON()  cbi(PRR, PRTIM1)
+#define TONE_POWER_OFF() sbi(PRR, PRTIM1)
+#endif
+
+/* Tone sequence stepped by the tick interrupt, idle while tone_length is 0 */
+const uint8_t *tone_notes;
+const uint8_t *tone_ticks;
+volatile uint8_t tone_length;
+uint8_t tone_index;
+uint8_t tone_count;
+uint8_t tone_loop;
+/* Timer1 prescaler select for the tone at the current clock */
+uint8_t tone_cs = TONE_CS_IDLE;
+/* Current ClockSet profile, and the ADC prescaler select for it */
+uint8_t clock_profile = CLOCK_IDLE;
+uint8_t adc_ps = ADC_PS_IDLE;
+
+#if defined(PROFILE) || defined(PULSE_TIMING)
+/* Shift from the Timer0 count to counts at F_CPU / T0_PRESCALE */
+uint8_t t0_shift;
+#endif
+#if !defined(TELEMETRY) && T0_FAST_SHIFT
+/* Timer0 counts at F_CPU / T0_PRESCALE too fine for the fast count, kept
+ * until the switch back */
+uint8_t t0_carry;
+#endif
+
+#ifdef PULSE_TIMING
+/* Timer0 counts since boot at the last tick, the air time totalled from
+ * the edges, and the start of the bubble in progress */
+volatile uint32_t pulse_base;
+volatile uint32_t pulse_air;
+uint32_t pulse_start;
+uint8_t pulse_in_air;
+#endif
+
+#ifdef PROFILE
+/* Counters since the last ProfileGet, and the tick and count TickWait last
+ * woke at */
+profile_t profile = {.count_us = PROF_COUNT_US};
+uint32_t prof_wake_ticks;
+uint8_t prof_wake_count;
+#define PROF_ENTER()    uint8_t prof_start = PROF_COUNT()
+#define PROF_EXIT(isr)  ProfISR(isr, prof_start)
+#else
+#define PROF_ENTER()
+#define PROF_EXIT(isr)
+#endif
+
+/* Block being written to EEPROM by EE_RDY_vect, idle while ee_len is 0 */
+const uint8_t *ee_data;
+uint16_t ee_addr;
+volatile uint8_t ee_len;
+
+/* ADMUX input for each channel: ADC1 (PB2), then ADC3 (PB3) */
+const uint8_t adc_mux[2] = {
+    (0 << MUX3) | (0 << MUX2) | (0 << MUX1) | (1 << MUX0),
+    (0 << MUX3) | (0 << MUX2) | (1 << MUX1) | (1 << MUX0),
+};
+
+#ifdef ADC_SLEEP
+// Sum of the conversions so far, written by ADC_vect
+volatile uint16_t adc_result;
+volatile uint8_t adc_done;
+// Conversions left in the oversampling burst
+uint8_t adc_count;
+#endif
+
+#ifdef COMP_WAKE
+/* Interrupt on the rising edge of ACO as the sensor drops below the level,
+ * or on both edges to time the pulses */
+#ifdef PULSE_TIMING
+#define COMP_EDGE       0
+#else
+#define COMP_EDGE       ((1 << ACIS1) | (1 << ACIS0))
+#endif
+/* Bandgap as the ADC input, MUX3:0 = 1100 */
+#define ADC_MUX_BANDGAP ((1 << MUX3) | (1 << MUX2))
+// Set by ANA_COMP_vect when the sensor drops below the bandgap
+volatile uint8_t comp_tripped;
+#endif
+
+#ifdef TELEMETRY
+/* Bytes waiting to be sent, bit reversed as the USI shifts out MSB first */
+uint8_t serial_buf[SERIAL_BUF_SIZE];
+volatile uint8_t serial_head;
+volatile uint8_t serial_tail;
+/* Second half of the frame being sent, 0 once it has been loaded */
+uint8_t serial_half;
+volatile uint8_t serial_busy;
+#endif
+
+/**
+  * @brief  Sets the clock prescaler and the GPIO directions, and turns off
+  *         everything not in use
+  * @return Nothing
+  */
+void HALInit (void)
+{
+    /* Set clock prescaler to F_OSC / F_CPU (64 for 125kHz) */
+    ClockPrescale(CLK_IDLE_PS);
+
+    /* Set B4, B1 and B0 to output */
+    DDRB = (1 << DDB4) | (1 << DDB1) | (1 << DDB0);
+
+    /* The analog comparator is off until CompArm, and the digital input
+     * buffers of the sensor inputs only draw current */
+    ACSR = (1 << ACD);
+#if ADC_CHANNELS > 1
+    DIDR0 = (1 << ADC1D) | (1 << ADC3D);
+#else
+    DIDR0 = (1 << ADC1D);
+#endif
+    PRR = PRR_GATED;
+}
+
+/**
+  * @brief  Switches the core between F_CPU and F_FAST. Interrupts are held
+  *         off while every peripheral prescaler is moved by CLOCK_RATIO.
+  * @param  profile - CLOCK_IDLE or CLOCK_FAST
+  * @return Nothing
+  */
+void ClockSet (uint8_t profile)
+{
+#if CLOCK_SHIFT
+    uint8_t sreg, shift;
+
+    if(profile == clock_profile) {
+        return;
+    }
+    shift = profile == CLOCK_FAST ? CLOCK_SHIFT : 0;
+    sreg = SREG;
+    cli();
+#ifdef ADC_STROBE
+    /* Let a triggered conversion finish at the clock it started on */
+    while(bit_is_set(ADCSRA, ADSC));
+#endif
+#if !defined(TELEMETRY) && T0_FAST_SHIFT
+    if(profile == CLOCK_IDLE) {
+        /* Still counting at /1024, so no count is lost between the read
+         * and the write. The low bits dropped on the way in go back */
+        OCR0A = T0_OCR;
+        TCNT0 = (TCNT0 << T0_FAST_SHIFT) | t0_carry;
+#ifdef ADC_STROBE
+        OCR0B = T0_OCRB;
+#endif
+#if defined(PROFILE) || defined(PULSE_TIMING)
+        t0_shift = 0;
+#endif
+    }
+#endif
+    ClockPrescale(profile == CLOCK_FAST ? CLK_FAST_PS : CLK_IDLE_PS);
+#ifndef TELEMETRY
+    /* Straight after the clock in both directions, so the few cycles
+     * Timer0 counts at the wrong rate are gained going fast and lost again
+     * coming back */
+    TCCR0B = profile == CLOCK_FAST ? T0_FAST_CS :
+             (0 << CS02) | (1 << CS01) | (0 << CS00);
+#if T0_FAST_SHIFT
+    if(profile == CLOCK_FAST) {
+        /* Now counting at /1024, carry the low bits to the switch back */
+        t0_carry = TCNT0;
+        TCNT0 = t0_carry >> T0_FAST_SHIFT;
+        t0_carry &= (1 << T0_FAST_SHIFT) - 1;
+        OCR0A = ((T0_OCR + 1) >> T0_FAST_SHIFT) - 1;
+#ifdef ADC_STROBE
+        OCR0B = T0_OCRB >> T0_FAST_SHIFT;
+#endif
+#if defined(PROFILE) || defined(PULSE_TIMING)
+        t0_shift = T0_FAST_SHIFT;
+#endif
+    }
+#endif
+#endif
+
+    /* Leave ADIF alone, writing it as 1 would clear it. The write is lost
+     * while the ADC is powered down, ADCPower sets adc_ps then */
+    adc_ps = ADC_PS_IDLE + shift;
+    ADCSRA = (ADCSRA & ~((1 << ADIF) | (1 << ADPS2) | (1 << ADPS1) |
+                         (1 << ADPS0))) | adc_ps;
+#ifdef TELEMETRY
+    TCCR0B = profile == CLOCK_FAST ? T0_FAST_CS : (1 << CS00);
+#ifndef POWER_DOWN
+    TCCR1 = (TCCR1 & 0xF0) | (T1_TICK_CS - CLOCK_SHIFT + shift);
+#endif
+#else
+    /* Only touch Timer1 while a note is playing, it is stopped otherwise */
+    tone_cs = TONE_CS_IDLE + shift;
+    if(TCCR1 & 0x0F) {
+        TCCR1 = TONE_ON;
+    }
+#endif
+    clock_profile = profile;
+    SREG = sreg;
+#endif
+}
+
+/**
+  * @brief  Starts playing a sequence of notes on PB1 in the background. The
+  *         first note is loaded on the next tick.
+  * @param  notes - Timer1 OCR value for each note, 0 for a rest
+  * @param  ticks - duration of each note in ticks
+  * @param  length - number of notes in the sequence
+  * @param  loop - non-zero to repeat the sequence until ToneStop
+  * @return Nothing
+  */
+void ToneStart (const uint8_t *notes, const uint8_t *ticks, uint8_t length,
+                uint8_t loop)
+{
+    cli();
+    TONE_POWER_ON();
+    tone_notes = notes;
+    tone_ticks = ticks;
+    tone_loop = loop;
+    tone_index = 0;
+    tone_count = 1;
+    tone_length = length;
+    sei();
+}
+
+/**
+  * @brief  Stops the tone sequence and the Timer1 counter
+  * @return Nothing
+  */
+void ToneStop (void)
+{
+    cli();
+    tone_length = 0;
+    TONE_SILENCE();
+    TONE_POWER_OFF();
+    sei();
+}
+
+/**
+  * @brief  Checks if a tone sequence is playing
+  * @return Non-zero while a sequence is playing
+  */
+uint8_t ToneBusy (void)
+{
+    return tone_length != 0;
+}
+
+/**
+  * @brief  ADC initialisation. Sets the ADMUX and ADCSRA registers.
+  * @return Nothing
+  */
+void ADCInit (void)
+{
+    /* Clear ADEN bit of register - halts all ADC processes */
+    cbi(ADCSRA, ADEN);
+    /* Setup ADMUX register */
+#ifdef COMP_WAKE
+    /* Reference voltage VCC, so the bandgap can be measured as an input */
+    ADMUX = (0 << REFS2) | (0 << REFS1) | (0 << REFS0);
+#else
+    ADMUX = (0 << REFS2) | (1 << REFS1) | (0 << REFS0); /* Set reference voltage to 1V1 */
+#endif
+    /* Select PB2 (ADC1) with single ended input */
+    ADMUX |= adc_mux[0];
+
+    ADCSRA |= (0 << ADATE); /* Auto trigger disabled */
+    /*
+     * Recommended ADC clock is between 50kHz and 200kHz
+     * If using internal 8MHz clock, prescaler must be 128 or 64
+     * If using 125kHz clock, prescaler must be 2 --> 62.5kHz
+     * ClockSet scales it with the core clock
+     */
+    ADCSRA |= ADC_PS_IDLE; /* Prescaler of 2 */
+
+    /* Enable ADC. Ref and channel selections will not go into effect until set */
+    sbi(ADCSRA, ADEN);
+#ifndef ADC_STROBE
+    /* Powered down until the first sample window, the strobe keeps it on */
+    ADCPower(0);
+#endif
+}
+
+/**
+  * @brief  Powers the ADC up or down. It must be disabled before its clock
+  *         is gated, and gets the prescaler for the current clock when it
+  *         comes back.
+  * @param  on - non-zero to power up
+  * @return Nothing
+  */
+void ADCPower (uint8_t on)
+{
+    if(on) {
+        cbi(PRR, PRADC);
+        ADCSRA = (ADCSRA & ~((1 << ADIF) | (1 << ADPS2) | (1 << ADPS1) |
+                             (1 << ADPS0))) | (1 << ADEN) | adc_ps;
+    } else {
+        cbi(ADCSRA, ADEN);
+        sbi(PRR, PRADC);
+    }
+}
+
+/**
+  * @brief  Selects the ADC input. The mux changes at once unless a
+  *         conversion is running, in which case it changes after it.
+  * @param  channel - sensor channel, 0 to ADC_CHANNELS - 1
+  * @return Nothing
+  */
+void ADCSelect (uint8_t channel)
+{
+    ADMUX = (ADMUX & ~((1 << MUX3) | (1 << MUX2) | (1 << MUX1) | (1 << MUX0)))
+            | adc_mux[channel];
+}
+
+#ifdef PULSE_TIMING
+/**
+  * @brief  Reads the time with interrupts off. A compare match the tick
+  *         interrupt has not run for yet has already ended the tick.
+  * @return Timer0 counts since boot
+  */
+static uint32_t PulseNow (void)
+{
+    uint32_t base = pulse_base;
+    uint8_t count = T0_COUNT();
+
+    if(bit_is_set(TIFR, OCF0A)) {
+        base += T0_OCR + 1;
+        count = T0_COUNT();
+    }
+    return base + count;
+}
+
+/**
+  * @brief  Stamps a sensor edge, with interrupts off
+  * @param  air - non-zero if the sensor now sees air
+  * @return Nothing
+  */
+static void PulseEdge (uint8_t air)
+{
+    uint32_t now = PulseNow();
+
+    if(air && !pulse_in_air) {
+        pulse_start = now;
+        pulse_in_air = 1;
+    } else if(!air && pulse_in_air) {
+        pulse_air += now - pulse_start;
+        pulse_in_air = 0;
+    }
+}
+
+uint32_t PulseTake (void)
+{
+    uint32_t air, now;
+    uint8_t sreg = SREG;
+
+    cli();
+    air = pulse_air;
+    pulse_air = 0;
+    if(pulse_in_air) {
+        now = PulseNow();
+        air += now - pulse_start;
+        pulse_start = now;
+    }
+    SREG = sreg;
+
+    return air * PULSE_COUNT_US;
+}
+#endif
+
+#ifdef COMP_WAKE
+/**
+  * @brief  Measures the bandgap against VCC. The first conversion after
+  *         switching to the bandgap may be off, so it is thrown away.
+  * @return Bandgap in ADC_BITS counts
+  */
+uint16_t CompLevel (void)
+{
+    uint8_t mux = ADMUX;
+    uint16_t level;
+
+    ADMUX = (mux & ~((1 << MUX3) | (1 << MUX2) | (1 << MUX1) | (1 << MUX0)))
+            | ADC_MUX_BANDGAP;
+    ADCGet();
+    level = ADCGet();
+    ADMUX = mux;
+
+    return level;
+}
+
+/**
+  * @brief  Starts or stops the comparator: bandgap on AIN+, the selected ADC
+  *         input on AIN-, interrupt on the rising edge of ACO as the sensor
+  *         drops below the bandgap. ACIE is cleared around every other
+  *         change to ACSR so they can not raise an interrupt.
+  * @param  on - non-zero to start
+  * @return Nothing
+  */
+void CompArm (uint8_t on)
+{
+#ifdef PULSE_TIMING
+    uint8_t sreg;
+
+#endif
+    if(on) {
+        /* The mux needs the ADC clocked but disabled */
+        cbi(PRR, PRADC);
+        sbi(ADCSRB, ACME);
+        ACSR = (1 << ACBG) | COMP_EDGE;
+        comp_tripped = 0;
+        ACSR = (1 << ACBG) | (1 << ACI) | (1 << ACIE) | COMP_EDGE;
+#ifdef PULSE_TIMING
+        /* Already below the level gives no edge */
+        sreg = SREG;
+        cli();
+        PulseEdge(bit_is_set(ACSR, ACO));
+        SREG = sreg;
+#endif
+    } else {
+        cbi(ACSR, ACIE);
+        ACSR = (1 << ACD) | (1 << ACI);
+        cbi(ADCSRB, ACME);
+        sbi(PRR, PRADC);
+#ifdef PULSE_TIMING
+        /* Nothing is timed until the next CompArm */
+        sreg = SREG;
+        cli();
+        PulseEdge(0);
+        SREG = sreg;
+#endif
+    }
+}
+
+/**
+  * @brief  Checks if the comparator has tripped. A sensor already below the
+  *         level when armed gives no edge, so ACO is checked as well.
+  * @return Non-zero once tripped
+  */
+uint8_t CompTripped (void)
+{
+    return comp_tripped || bit_is_set(ACSR, ACO);
+}
+
+uint8_t CompBelow (void)
+{
+    return bit_is_set(ACSR, ACO);
+}
+#endif
+
+/**
+  * @brief  Interrupt initialisation. Sets the GIMSK and PCMSK registers.
+  * @return Nothing
+  */
+void IntInit (void)
+{
+#if ADC_CHANNELS == 1
+    /* Enable external interrupts */
+    sbi(GIMSK, PCIE);
+    /* Enable PCINT3 */
+    sbi(PCMSK, PCINT3);
+#endif
+    /* Enable interrupts */
+    sei();
+}
+
+/**
+ * @brief Retrieves a reading from the selected analog input. With
+ *        OVERSAMPLE_BITS this is a burst of ADC_OVERSAMPLE conversions
+ *        (~0.2ms each) summed and shifted down to ADC_BITS.
+ * @return ADC_BITS bit digital value
+ */
+uint16_t ADCGet (void)
+{
+#ifdef ADC_SLEEP
+    /*
+     * Entering ADC noise reduction sleep starts the conversion and halts the
+     * CPU and I/O clocks until it completes. Other interrupts (e.g. the
+     * switch) can wake the core early, so sleep again until ADC_vect has run.
+     * The conversion already in progress is not restarted by sleeping again.
+     * ADC_vect adds each conversion of the burst to adc_result, and each
+     * sleep after one that is not the last starts the next.
+     */
+    adc_result = 0;
+    adc_count = ADC_OVERSAMPLE;
+    adc_done = 0;
+    sbi(ADCSRA, ADIE);
+#ifdef ADC_SLEEP_IDLE
+    /* Keep Timer0 running, idle sleep needs the conversion started */
+    sbi(ADCSRA, ADSC);
+    set_sleep_mode(SLEEP_MODE_IDLE);
+#else
+    set_sleep_mode(SLEEP_MODE_ADC);
+#endif
+    sleep_enable();
+    cli();
+    while(!adc_done) {
+        sei();
+        sleep_cpu();
+        cli();
+    }
+    sei();
+    sleep_disable();
+    cbi(ADCSRA, ADIE);
+
+    return adc_result >> OVERSAMPLE_BITS;
+#else
+    uint16_t sum = 0;
+    uint8_t high, low, i;
+
+    for(i = 0; i < ADC_OVERSAMPLE; i++) {
+        sbi(ADCSRA, ADSC); /* Start conversion */
+        while(bit_is_set(ADCSRA, ADSC)); /* Wait for conversion to finish */
+
+        /* Lower byte must be read first */
+        low = ADCL;
+        high = ADCH;
+        sum += (high << 8) | low;
+    }
+#ifdef PROFILE
+    profile.conversions += ADC_OVERSAMPLE;
+#endif
+
+    return sum >> OVERSAMPLE_BITS;
+#endif
+}
+
+/**
+  * @brief  Timer0 initialisation. Sets up a CTC compare match interrupt every
+  *         TICK_MS to drive the task scheduler (Timer1 with TELEMETRY, the
+  *         watchdog with POWER_DOWN).
+  * @return Nothing
+  */
+void TickInit (void)
+{
+#ifdef POWER_DOWN
+    /* Watchdog interrupt (no reset) every ~16ms, WDP3:0 = 0. WDRF would
+     * force WDE on, and the change needs WDCE and WDE written first */
+    cbi(MCUSR, WDRF);
+    WDTCR = (1 << WDCE) | (1 << WDE);
+    WDTCR = (1 << WDIE);
+#elif defined(TELEMETRY)
+    /* Timer1 in CTC mode, TOP = OCR1C, interrupt when TCNT1 reaches OCR1A */
+    OCR1C = T0_OCR;
+    OCR1A = T0_OCR;
+    sbi(TIMSK, OCIE1A); /* Enable compare match A interrupt */
+    TCCR1 = (1 << CTC1) | (1 << CS12); /* Start w. prescaler of 8 */
+#else
+    TCCR0A = (1 << WGM01); /* CTC mode, TOP = OCR0A */
+    OCR0A = T0_OCR;
+    sbi(TIMSK, OCIE0A); /* Enable compare match A interrupt */
+    TCCR0B = (0 << CS02) | (1 << CS01) | (0 << CS00); /* Start w. prescaler of 8 */
+#endif
+}
+
+#ifdef ADC_STROBE
+/**
+  * @brief  Starts timer triggered sampling. The ADC is auto triggered by
+  *         Timer0 compare match B. The trigger fires on the rising edge of
+  *         OCF0B, which is left set (no interrupt clears it) so only the
+  *         ticks that clear it in the tick ISR start a conversion.
+  * @param  period - sample period in ticks
+  * @return Nothing
+  */
+void StrobeInit (uint8_t period)
+{
+    cli();
+    strobe_period = period;
+    strobe_phase = period - 1;
+    strobe_sum = 0;
+    strobe_count = ADC_OVERSAMPLE;
+    OCR0B = T0_OCRB;
+    /* Trigger source Timer0 compare match B */
+    ADCSRB = (1 << ADTS2) | (0 << ADTS1) | (1 << ADTS0);
+    /* Auto trigger and conversion complete interrupt enabled. Leave ADIF
+     * alone, writing it back as 1 would clear a pending conversion */
+    ADCSRA = (ADCSRA & ~(1 << ADIF)) | (1 << ADATE) | (1 << ADIE);
+    sei();
+}
+
+/**
+  * @brief  Collects the latest pair of readings from the strobe
+  * @param  on_value - reading with the sensor LED on
+  * @param  off_value - dark reading from the same period
+  * @return 1 if a new pair was collected, 0 otherwise
+  */
+uint8_t StrobeGet (uint16_t *on_value, uint16_t *off_value)
+{
+    uint8_t ready;
+
+    cli();
+    ready = strobe_ready;
+    if(ready) {
+        *on_value = strobe_on;
+        *off_value = strobe_off;
+        strobe_ready = 0;
+    }
+    sei();
+
+    return ready;
+}
+#endif
+
+#ifdef TELEMETRY
+/**
+  * @brief  Starts the serial output. Timer0 runs in CTC mode at the bit rate
+  *         and clocks the USI in three wire mode, so only the USI counter
+  *         overflow needs an interrupt, twice per byte.
+  * @return Nothing
+  */
+void SerialInit (void)
+{
+    /* PB1 idles high while the USI is off */
+    sbi(PORTB, PORTB1);
+    TCCR0A = (1 << WGM01); /* CTC mode, TOP = OCR0A */
+    OCR0A = T0_BAUD_OCR;
+    TCCR0B = (1 << CS00); /* No prescaler */
+}
+
+/**
+  * @brief  Checks how many bytes SerialPut can queue
+  * @return Free space in the transmit buffer
+  */
+uint8_t SerialFree (void)
+{
+    return (serial_tail - serial_head - 1) & (SERIAL_BUF_SIZE - 1);
+}
+
+/**
+  * @brief  Queues a byte and starts the USI if it is idle
+  * @param  data - byte to send
+  * @return Nothing
+  */
+void SerialPut (uint8_t data)
+{
+    uint8_t reversed = 0, i;
+
+    /* UART frames are sent LSB first */
+    for(i = 0; i < 8; i++) {
+        reversed = (reversed << 1) | (data & 1);
+        data >>= 1;
+    }
+    serial_buf[serial_head] = reversed;
+    serial_head = (serial_head + 1) & (SERIAL_BUF_SIZE - 1);
+
+    /* USI_OVF_vect clears serial_busy only once the buffer is empty, so
+     * checking after the byte is queued can not miss it */
+    if(!serial_busy) {
+        serial_busy = 1;
+        /* Send one idle bit, then USI_OVF_vect loads the first frame */
+        USIDR = 0xFF;
+        USISR = (1 << USIOIF) | (16 - 1);
+        USICR = (1 << USIOIE) | (1 << USIWM0) | (1 << USICS0);
+    }
+}
+#endif
+
+/**
+  * @brief  Sleeps in idle mode until at least one tick has elapsed.
+  *         Interrupts are disabled while checking so a tick can not arrive
+  *         between the check and the sleep.
+  * @return Number of ticks elapsed since the last call
+  */
+uint8_t TickWait (void)
+{
+    uint8_t ticks, mode = SLEEP_MODE_IDLE;
+#ifdef PROFILE
+    uint32_t now;
+    uint16_t awake;
+    uint8_t count;
+#endif
+
+    cli();
+    if(!tick_pending) {
+#ifdef PROFILE
+        /* A compare match not serviced yet has already ended the tick */
+        now = profile.ticks;
+        count = PROF_COUNT();
+        if(bit_is_set(TIFR, PROF_TICK_FLAG)) {
+            now++;
+            count = PROF_COUNT();
+        }
+        awake = (uint16_t)(now - prof_wake_ticks) * (T0_OCR + 1) + count -
+                prof_wake_count;
+        profile.awake += awake;
+        if(awake > profile.awake_max) {
+            profile.awake_max = awake;
+        }
+#endif
+#ifdef POWER_DOWN
+        /* Power down unless something clocked from the core is running:
+         * a tone on Timer1, or the serial output on Timer0 */
+#ifdef TELEMETRY
+        if(!serial_busy) {
+#else
+        if(!tone_length) {
+#endif
+            mode = SLEEP_MODE_PWR_DOWN;
+        }
+#endif
+        /* The tick timer must keep running while asleep, and ADCGet may
+         * have left the noise reduction mode selected */
+        set_sleep_mode(mode);
+        sleep_enable();
+#ifdef POWER_DOWN
+        if(mode == SLEEP_MODE_PWR_DOWN) {
+            /* Brown-out detector off while asleep, BODS lasts 3 cycles */
+            sleep_bod_disable();
+        }
+#endif
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        cli();
+#ifdef PROFILE
+        /* Woken by an interrupt that has run, so the flag is clear */
+        prof_wake_ticks = profile.ticks;
+        prof_wake_count = PROF_COUNT();
+#endif
+    }
+    ticks = tick_pending;
+    tick_pending = 0;
+    sei();
+
+    return ticks;
+}
+
+#ifdef PROFILE
+/**
+  * @brief  Adds an interrupt's run time to its counters. Interrupts are
+  *         taken to finish within a tick.
+  * @param  isr - one of the PROF_ interrupts
+  * @param  start - timer count when the interrupt was entered
+  * @return Nothing
+  */
+void ProfISR (uint8_t isr, uint8_t start)
+{
+    uint8_t count = PROF_COUNT();
+
+    if(count < start) {
+        count += T0_OCR + 1;
+    }
+    profile.isr_calls[isr]++;
+    profile.isr_counts[isr] += count - start;
+}
+
+/**
+  * @brief  Reads the profiling counters and starts them again from 0
+  * @param  prof - filled with the counters since the previous call
+  * @return Nothing
+  */
+void ProfileGet (profile_t *prof)
+{
+    cli();
+    *prof = profile;
+    memset(&profile, 0, sizeof(profile));
+    profile.count_us = PROF_COUNT_US;
+    sei();
+}
+#endif
+
+/**
+  * @brief  Reads the switch on PB3
+  * @return Non-zero while the switch is on (high)
+  */
+uint8_t SwitchRead (void)
+{
+#if ADC_CHANNELS == 1
+    return bit_is_set(PINB, PINB3) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+/**
+  * @brief  Reads a block from EEPROM, waiting for any write to finish first
+  *         so EE_RDY_vect can not move EEAR under the read
+  * @param  addr - EEPROM address
+  * @param  data - buffer to read into
+  * @param  len - number of bytes
+  * @return Nothing
+  */
+void EEPROMRead (uint16_t addr, void *data, uint8_t len)
+{
+    while(ee_len);
+    eeprom_read_block(data, (const void *)addr, len);
+}
+
+/**
+  * @brief  Starts writing a block to EEPROM in the background
+  * @param  addr - EEPROM address
+  * @param  data - bytes to write, must not change until EEPROMBusy returns 0
+  * @param  len - number of bytes
+  * @return Nothing
+  */
+void EEPROMWrite (uint16_t addr, const void *data, uint8_t len)
+{
+    while(ee_len);
+    cli();
+    ee_data = data;
+    ee_addr = addr;
+    ee_len = len;
+    sbi(EECR, EERIE); /* EE_RDY_vect fires as soon as EEPE is clear */
+    sei();
+}
+
+/**
+  * @brief  Checks if a background EEPROM write is still running
+  * @return Non-zero while writing
+  */
+uint8_t EEPROMBusy (void)
+{
+    return ee_len != 0;
+}
+
+/**
+  * @brief  Turns the sensor LED on PB4 on or off
+  * @param  on - non-zero to turn the LED on
+  * @return Nothing
+  */
+void SensorLED (uint8_t on)
+{
+    if(on) {
+        sbi(PORTB, PORTB4);
+    } else {
+        cbi(PORTB, PORTB4);
+    }
+}
+
+/**
+  * @brief  Waits SENSOR_SETTLE_US for the sensor LED to settle, busy at the
+  *         idle clock so _delay_us is timed right and costs the least
+  * @return Nothing
+  */
+void SensorSettle (void)
+{
+    uint8_t current = clock_profile;
+
+    ClockSet(CLOCK_IDLE);
+    _delay_us(SENSOR_SETTLE_US);
+    ClockSet(current);
+}
+
+/**
+  * @brief  Turns the status LED on PB0 on or off
+  * @param  on - non-zero to turn the LED on
+  * @return Nothing
+  */
+void StatusLED (uint8_t on)
+{
+    if(on) {
+        sbi(PORTB, PORTB0);
+    } else {
+        cbi(PORTB, PORTB0);
+    }
+}
+
+/**
+ * @brief Tick interrupt, Timer0 (Timer1 with TELEMETRY) compare match A or
+ *        the watchdog with POWER_DOWN, fires every TICK_MS. Also steps the
+ *        tone sequence started by ToneStart.
+ * @param TICK_vect - tick timer compare match A vector
+ * @return Nothing
+ */
+ISR(TICK_vect)
+{
+    PROF_ENTER();
+    uint8_t ocr;
+
+    tick_pending++;
+#ifdef PROFILE
+    profile.ticks++;
+#endif
+#ifdef PULSE_TIMING
+    pulse_base += T0_OCR + 1;
+#endif
+
+#ifdef ADC_STROBE
+    /* Arm the next compare match B trigger by clearing OCF0B: with the LED
+     * turned on at the start of the period, and for the dark reading half a
+     * period later */
+    if(++strobe_phase == strobe_period) {
+        strobe_phase = 0;
+        sbi(PORTB, PORTB4);
+        TIFR = (1 << OCF0B);
+    } else if(strobe_phase == (strobe_period >> 1)) {
+        TIFR = (1 << OCF0B);
+    }
+#endif
+
+    /* Step the tone sequence, only touching Timer1 when a note changes */
+    if(tone_length && --tone_count == 0) {
+        if(tone_index == tone_length && !tone_loop) {
+            tone_length = 0;
+            TONE_SILENCE();
+            TONE_POWER_OFF();
+        } else {
+            if(tone_index == tone_length) {
+                tone_index = 0;
+            }
+            ocr = tone_notes[tone_index];
+            if(ocr) {
+                TONE_NOTE(ocr);
+            } else {
+                TONE_SILENCE();
+            }
+            tone_count = tone_ticks[tone_index++];
+        }
+    }
+    PROF_EXIT(PROF_TICK);
+}
+
+/**
+ * @brief PCINT0 external pin interrupt on pin B3
+ * @param PCINT0_vect - External interrupt vector
+ * @return Nothing
+ */
+ISR(PCINT0_vect)
+{
+    PROF_ENTER();
+    timer_flag = 1;
+    PROF_EXIT(PROF_PCINT);
+}
+
+/**
+ * @brief EEPROM ready interrupt. Checks one byte of the block per call and
+ *        writes it if it differs from what is stored, ~3.4ms each. A byte
+ *        that is skipped leaves EEPE clear so the interrupt fires again
+ *        straight away, with other interrupts able to run in between.
+ *        Disables itself once the block is done.
+ * @param EE_RDY_vect - EEPROM ready vector
+ * @return Nothing
+ */
+ISR(EE_RDY_vect)
+{
+    PROF_ENTER();
+
+    if(!ee_len) {
+        cbi(EECR, EERIE);
+    } else {
+        EEAR = ee_addr++;
+        sbi(EECR, EERE);
+        ee_len--;
+        if(EEDR != *ee_data) {
+            EEDR = *ee_data;
+            /* Erase and write, EEPE must follow EEMPE within 4 cycles */
+            EECR = (1 << EERIE) | (1 << EEMPE);
+            sbi(EECR, EEPE);
+        }
+        ee_data++;
+    }
+    PROF_EXIT(PROF_EEPROM);
+}
+
+#ifdef ADC_STROBE
+/**
+ * @brief ADC conversion complete interrupt for the strobe. Stores the LED on
+ *        reading and turns the LED off, or stores the dark reading and
+ *        marks the pair as ready. With OVERSAMPLE_BITS each triggered
+ *        conversion starts a burst, the rest started from here.
+ * @param ADC_vect - ADC vector as specified for ATtiny85
+ * @return Nothing
+ */
+ISR(ADC_vect)
+{
+    PROF_ENTER();
+    uint16_t value;
+
+#ifdef PROFILE
+    profile.conversions++;
+#endif
+    strobe_sum += ADC;
+    if(--strobe_count) {
+        sbi(ADCSRA, ADSC);
+    } else {
+        value = strobe_sum >> OVERSAMPLE_BITS;
+        strobe_sum = 0;
+        strobe_count = ADC_OVERSAMPLE;
+
+        if(bit_is_set(PORTB, PORTB4)) {
+            strobe_on = value;
+            cbi(PORTB, PORTB4);
+        } else {
+            strobe_off = value;
+            strobe_ready = 1;
+        }
+    }
+    PROF_EXIT(PROF_ADC);
+}
+#endif
+
+#ifdef ADC_SLEEP
+/**
+ * @brief ADC conversion complete interrupt, wakes ADCGet from noise
+ *        reduction sleep. Adds the conversion to the burst and marks the
+ *        reading done after the last one.
+ * @param ADC_vect - ADC vector as specified for ATtiny85
+ * @return Nothing
+ */
+ISR(ADC_vect)
+{
+    PROF_ENTER();
+
+#ifdef PROFILE
+    profile.conversions++;
+#endif
+    adc_result += ADC;
+    if(--adc_count == 0) {
+        adc_done = 1;
+    }
+#ifdef ADC_SLEEP_IDLE
+    else {
+        /* Idle sleep does not start conversions */
+        sbi(ADCSRA, ADSC);
+    }
+#endif
+    PROF_EXIT(PROF_ADC);
+}
+#endif
+
+#ifdef COMP_WAKE
+/**
+ * @brief Analog comparator interrupt, the sensor has dropped below the
+ *        bandgap. Latches the trip and disables itself until CompArm, or
+ *        with PULSE_TIMING stamps every edge.
+ * @param ANA_COMP_vect - Analog comparator vector
+ * @return Nothing
+ */
+ISR(ANA_COMP_vect)
+{
+#ifdef PULSE_TIMING
+    /* Both edges interrupt, stamped until CompArm disarms */
+    uint8_t air = bit_is_set(ACSR, ACO);
+
+    PulseEdge(air);
+    if(air) {
+        comp_tripped = 1;
+    }
+#else
+    comp_tripped = 1;
+    cbi(ACSR, ACIE);
+#endif
+}
+#endif
+
+#ifdef TELEMETRY
+/**
+ * @brief USI counter overflow interrupt. Each frame (start bit, 8 data bits
+ *        and a stop bit) is shifted out of DO in two loads of 5 bits. The
+ *        6th bit of each load repeats the first bit of the next, since it
+ *        shows on DO from the overflow until USIDR is reloaded here.
+ * @param USI_OVF_vect - USI overflow vector
+ * @return Nothing
+ */
+ISR(USI_OVF_vect)
+{
+    PROF_ENTER();
+    uint8_t data;
+
+    if(serial_half) {
+        /* d4-d7 and the stop bit */
+        USIDR = serial_half;
+        serial_half = 0;
+        USISR = (1 << USIOIF) | (16 - 5);
+    } else if(serial_tail != serial_head) {
+        /* Start bit and d0-d4, the buffer holds the byte bit reversed */
+        data = serial_buf[serial_tail];
+        serial_tail = (serial_tail + 1) & (SERIAL_BUF_SIZE - 1);
+        USIDR = data >> 1;
+        serial_half = (data << 4) | 0x0F;
+        USISR = (1 << USIOIF) | (16 - 5);
+    } else {
+        /* Nothing left, PORTB1 holds the line high */
+        USICR = 0;
+        USISR = (1 << USIOIF);
+        serial_busy = 0;
+    }
+    PROF_EXIT(PROF_USI);
+}
+#endif
@@ -0,0 +1,526 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/hal_host.c
+  * @brief   Linux backend of the JG2016-04 hardware abstraction layer.
+  *          ADC samples are read from HAL_ADC_FILE (stdin if unset), one
+  *          decimal ADC_BITS bit reading per line, or supplied by
+  *          HALSetADCSource().
+  *          With ADC_STROBE a second reading on the line is the dark
+  *          reading (0 if missing), and with ADC_CHANNELS of 2 it is the
+  *          channel 1 reading (the channel 0 reading if missing). A
+  *          line containing "switch" turns the PB3 switch on and "switch off"
+  *          turns it off. The EEPROM is loaded from and saved to
+  *          HAL_EEPROM_FILE when it is set. With TELEMETRY the serial
+  *          output is written to HAL_SERIAL_FILE, drained at SERIAL_BAUD so
+  *          a full transmit buffer drops data as it would on the ATtiny85.
+  *          With COMP_WAKE the comparator trips on readings below
+  *          HAL_COMP_LEVEL counts (the bandgap against a 3.3V VCC if unset).
+  *          While armed it takes the next reading every sample period the
+  *          detector last sampled at (50ms until there is one), and the
+  *          first sample after it reads the reading it stopped on.
+  *          Status LED and tone changes are printed as "ms,event" lines and
+  *          the program exits when the samples run out.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+// Interrupt counter for switch
+volatile uint8_t timer_flag;
+
+/* Simulated time and the outputs last reported */
+static uint32_t host_ticks;
+static uint32_t host_samples;
+static uint8_t host_status = 0xFF;
+
+/* Tone sequence, stepped in TickWait as the AVR steps it in the tick ISR */
+static uint8_t tone_length;
+static uint8_t tone_count;
+static uint8_t tone_index;
+static uint8_t tone_loop;
+static const uint8_t *tone_ticks;
+
+#ifdef ADC_STROBE
+/* Strobe period in ticks and the dark reading for the current sample */
+static uint8_t strobe_period;
+static uint16_t host_dark;
+#endif
+
+static uint8_t host_switch;
+static uint8_t host_eeprom[EEPROM_SIZE];
+static const char *eeprom_path;
+
+#ifdef PROFILE
+/* Only the tick and conversion counts mean anything off-target, count_us
+ * is left 0 so nothing is taken as a time */
+static profile_t profile;
+#endif
+
+#ifdef TELEMETRY
+/* Bytes queued on the simulated link and the drain in thousandths of a byte */
+static FILE *serial_file;
+static uint8_t serial_queued;
+static uint16_t serial_drain;
+#endif
+
+static FILE *adc_file;
+static int (*adc_source)(uint16_t *value);
+/* Selected channel and the readings from the current line */
+static uint8_t adc_channel;
+static uint16_t adc_values[ADC_CHANNELS];
+
+#ifdef COMP_WAKE
+/* Bandgap against VCC when HAL_COMP_LEVEL is unset, and the period of the
+ * default 20Hz sample rate */
+#define HOST_VCC_MV     3300
+#define HOST_COMP_TICKS (50 / TICK_MS)
+/* Comparator level, and its state while armed. The ticks between the last
+ * two samples taken without the comparator in between set how often it
+ * takes a reading */
+static uint16_t comp_level;
+static uint8_t comp_on;
+static uint8_t comp_tripped;
+static uint8_t comp_held;
+static uint8_t comp_between;
+static uint16_t comp_count;
+static uint32_t adc_tick;
+static uint32_t adc_period = HOST_COMP_TICKS;
+#ifdef PULSE_TIMING
+/* Air time since the last PulseTake, a sample period per reading below */
+static uint32_t pulse_air;
+#endif
+#endif
+
+/**
+  * @brief  Replaces the sample file with a callback, e.g. for a synthetic
+  *         waveform. The callback returns 0 once it has no more samples.
+  * @param  source - callback that writes the next ADC reading to *value
+  * @return Nothing
+  */
+void HALSetADCSource (int (*source)(uint16_t *value))
+{
+    adc_source = source;
+}
+
+/**
+  * @brief  Prints the run totals and ends the program
+  * @return Nothing
+  */
+static void HostExit (void)
+{
+#ifdef TELEMETRY
+    if(serial_file) {
+        fclose(serial_file);
+    }
+#endif
+    fprintf(stderr, "%lu samples, %lu ms\n",
+            (unsigned long)host_samples, (unsigned long)host_ticks * TICK_MS);
+    exit(0);
+}
+
+/**
+  * @brief  Reads the next reading from the sample file
+  * @param  value - next ADC reading
+  * @return 1 if a reading was read, 0 at the end of the file
+  */
+static int FileSource (uint16_t *value)
+{
+    char line[32];
+    char *end;
+#if ADC_CHANNELS > 1
+    char *start;
+#endif
+    unsigned long reading;
+
+    while(fgets(line, sizeof(line), adc_file)) {
+        if(strncmp(line, "switch", 6) == 0) {
+            host_switch = strncmp(line, "switch off", 10) != 0;
+            timer_flag = 1;
+            continue;
+        }
+        reading = strtoul(line, &end, 10);
+        if(end == line) {
+            /* Skip blank lines and comments */
+            continue;
+        }
+        *value = reading > ADC_MAX ? ADC_MAX : (uint16_t)reading;
+#ifdef ADC_STROBE
+        /* An optional second reading is the dark reading */
+        reading = strtoul(end, NULL, 10);
+        host_dark = reading > ADC_MAX ? ADC_MAX : (uint16_t)reading;
+#endif
+#if ADC_CHANNELS > 1
+        /* An optional second reading is channel 1 */
+        start = end;
+        reading = strtoul(start, &end, 10);
+        adc_values[1] = end == start ? *value :
+                        reading > ADC_MAX ? ADC_MAX : (uint16_t)reading;
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+void HALInit (void)
+{
+    const char *path;
+    FILE *eeprom;
+
+    /* Erased EEPROM reads 0xFF */
+    memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+    eeprom_path = getenv("HAL_EEPROM_FILE");
+    if(eeprom_path) {
+        eeprom = fopen(eeprom_path, "rb");
+        if(eeprom) {
+            if(fread(host_eeprom, 1, sizeof(host_eeprom), eeprom) == 0) {
+                memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+            }
+            fclose(eeprom);
+        }
+    }
+
+#ifdef COMP_WAKE
+    path = getenv("HAL_COMP_LEVEL");
+    comp_level = path ? (uint16_t)strtoul(path, NULL, 10) :
+                 (uint16_t)(1100UL * ADC_MAX / HOST_VCC_MV);
+#endif
+
+    if(adc_source) {
+        return;
+    }
+    path = getenv("HAL_ADC_FILE");
+    if(path) {
+        adc_file = fopen(path, "r");
+        if(!adc_file) {
+            perror(path);
+            exit(1);
+        }
+    } else {
+        adc_file = stdin;
+    }
+    adc_source = FileSource;
+}
+
+#ifdef COMP_WAKE
+/**
+  * @brief  Takes the next reading for the armed comparator, tripping it if
+  *         the reading is below the level
+  * @return Nothing
+  */
+static void CompRead (void)
+{
+    if(!adc_source(&adc_values[0])) {
+        HostExit();
+    }
+    host_samples++;
+    comp_held = 1;
+    if(adc_values[0] < comp_level) {
+        comp_tripped = 1;
+#ifdef PULSE_TIMING
+        pulse_air += adc_period * TICK_MS * 1000UL;
+#endif
+    }
+}
+#endif
+
+void ADCInit (void)
+{
+}
+
+/**
+  * @brief  Reads the next line of readings when channel 0 is selected,
+  *         otherwise returns the selected channel from the current line.
+  *         A HALSetADCSource callback supplies channel 0 only, the other
+  *         channels read the same.
+  * @return Reading for the selected channel
+  */
+uint16_t ADCGet (void)
+{
+    uint16_t value;
+    uint8_t i;
+
+#ifdef PROFILE
+    profile.conversions += ADC_OVERSAMPLE;
+#endif
+#if ADC_CHANNELS > 1
+    if(adc_channel != 0) {
+        return adc_values[adc_channel];
+    }
+#endif
+#ifdef COMP_WAKE
+    /* The sensor has not moved on since the comparator's last reading */
+    if(comp_held) {
+        comp_held = 0;
+        return adc_values[0];
+    }
+#endif
+    if(!adc_source(&value)) {
+        HostExit();
+    }
+    host_samples++;
+#ifdef COMP_WAKE
+    if(!comp_between && adc_tick && host_ticks > adc_tick) {
+        adc_period = host_ticks - adc_tick;
+    }
+    comp_between = 0;
+    adc_tick = host_ticks;
+#endif
+    if(adc_source != FileSource) {
+        for(i = 1; i < ADC_CHANNELS; i++) {
+            adc_values[i] = value;
+        }
+    }
+    adc_values[0] = value;
+
+    return value;
+}
+
+void ADCSelect (uint8_t channel)
+{
+    adc_channel = channel;
+}
+
+#ifdef ADC_STROBE
+void StrobeInit (uint8_t period)
+{
+    strobe_period = period;
+}
+
+/**
+  * @brief  Returns a pair once per strobe period, at the tick the AVR would
+  *         finish the dark reading
+  * @return 1 if a new pair was collected, 0 otherwise
+  */
+uint8_t StrobeGet (uint16_t *on_value, uint16_t *off_value)
+{
+    if(host_ticks % strobe_period != (strobe_period >> 1)) {
+        return 0;
+    }
+    *on_value = ADCGet();
+    *off_value = host_dark;
+    return 1;
+}
+#endif
+
+void IntInit (void)
+{
+}
+
+#ifdef PROFILE
+void ProfileGet (profile_t *prof)
+{
+    *prof = profile;
+    memset(&profile, 0, sizeof(profile));
+}
+#endif
+
+void TickInit (void)
+{
+}
+
+/**
+  * @brief  Advances simulated time by one tick without sleeping
+  * @return Always 1
+  */
+uint8_t TickWait (void)
+{
+    host_ticks++;
+#ifdef PROFILE
+    profile.ticks++;
+#endif
+#ifdef COMP_WAKE
+    if(comp_on && ++comp_count >= adc_period) {
+        comp_count = 0;
+        CompRead();
+    }
+#endif
+#ifdef TELEMETRY
+    /* 10 bits per byte on the line */
+    serial_drain += (uint32_t)SERIAL_BAUD * TICK_MS / 10;
+    while(serial_queued && serial_drain >= 1000) {
+        serial_queued--;
+        serial_drain -= 1000;
+    }
+    if(!serial_queued) {
+        serial_drain = 0;
+    }
+#endif
+    if(tone_length && --tone_count == 0) {
+        if(tone_index == tone_length) {
+            if(!tone_loop) {
+                tone_length = 0;
+                printf("%lu,tone off\n", (unsigned long)host_ticks * TICK_MS);
+                return 1;
+            }
+            tone_index = 0;
+        }
+        tone_count = tone_ticks[tone_index++];
+    }
+    return 1;
+}
+
+#ifdef TELEMETRY
+void SerialInit (void)
+{
+    const char *path = getenv("HAL_SERIAL_FILE");
+
+    if(path) {
+        serial_file = fopen(path, "wb");
+        if(!serial_file) {
+            perror(path);
+            exit(1);
+        }
+    }
+}
+
+uint8_t SerialFree (void)
+{
+    return SERIAL_BUF_SIZE - 1 - serial_queued;
+}
+
+void SerialPut (uint8_t data)
+{
+    serial_queued++;
+    if(serial_file) {
+        fputc(data, serial_file);
+    }
+}
+#endif
+
+uint8_t SwitchRead (void)
+{
+    return host_switch;
+}
+
+void EEPROMRead (uint16_t addr, void *data, uint8_t len)
+{
+    memcpy(data, &host_eeprom[addr], len);
+}
+
+/**
+  * @brief  Writes the block at once and saves the EEPROM to HAL_EEPROM_FILE
+  * @return Nothing
+  */
+void EEPROMWrite (uint16_t addr, const void *data, uint8_t len)
+{
+    FILE *eeprom;
+
+    memcpy(&host_eeprom[addr], data, len);
+    printf("%lu,eeprom %u\n", (unsigned long)host_ticks * TICK_MS, addr);
+    if(eeprom_path) {
+        eeprom = fopen(eeprom_path, "wb");
+        if(eeprom) {
+            fwrite(host_eeprom, 1, sizeof(host_eeprom), eeprom);
+            fclose(eeprom);
+        }
+    }
+}
+
+uint8_t EEPROMBusy (void)
+{
+    return 0;
+}
+
+void ClockSet (uint8_t profile)
+{
+}
+
+void ADCPower (uint8_t on)
+{
+}
+
+void SensorSettle (void)
+{
+}
+
+#ifdef COMP_WAKE
+uint16_t CompLevel (void)
+{
+    return comp_level;
+}
+
+/**
+  * @brief  Starts or stops the comparator model, which reads the samples in
+  *         TickWait while it is on
+  * @param  on - non-zero to start
+  * @return Nothing
+  */
+void CompArm (uint8_t on)
+{
+    comp_on = on;
+    if(on) {
+        comp_tripped = 0;
+        comp_count = 0;
+        comp_between = 1;
+    }
+}
+
+uint8_t CompTripped (void)
+{
+    return comp_tripped;
+}
+
+uint8_t CompBelow (void)
+{
+    return adc_values[0] < comp_level;
+}
+#endif
+
+#ifdef PULSE_TIMING
+/**
+  * @brief  Air is timed to a sample period rather than a timer count, from
+  *         the readings the comparator took
+  * @return Air time in us
+  */
+uint32_t PulseTake (void)
+{
+    uint32_t air = pulse_air;
+
+    pulse_air = 0;
+    return air;
+}
+#endif
+
+void SensorLED (uint8_t on)
+{
+}
+
+void StatusLED (uint8_t on)
+{
+    on = on ? 1 : 0;
+    if(on != host_status) {
+        host_status = on;
+        printf("%lu,status %s\n", (unsigned long)host_ticks * TICK_MS,
+               on ? "on" : "off");
+    }
+}
+
+void ToneStart (const uint8_t *notes, const uint8_t *ticks, uint8_t length,
+                uint8_t loop)
+{
+    tone_ticks = ticks;
+    tone_loop = loop;
+    tone_index = 0;
+    tone_count = 1;
+    tone_length = length;
+    printf("%lu,tone %s\n", (unsigned long)host_ticks * TICK_MS,
+           loop ? "loop" : "on");
+}
+
+void ToneStop (void)
+{
+    if(tone_length) {
+        tone_length = 0;
+        printf("%lu,tone off\n", (unsigned long)host_ticks * TICK_MS);
+    }
+}
+
+uint8_t ToneBusy (void)
+{
+    return tone_length != 0;
+}
@@ -0,0 +1,60 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/logdump.c
+  * @brief   Prints the event log from an EEPROM image as "ms,event arg"
+  *          lines, e.g.
+  *
+  *          avrdude -c usbasp -p attiny85 -U eeprom:r:eeprom.bin:r
+  *          HAL_EEPROM_FILE=eeprom.bin ./logdump
+  *
+  *          Times are ms since the boot record before them. Bubble durations
+  *          are in ms, calibrations give the water value, alarms the uL
+  *          of air in the window and comp events the comparator level that
+  *          the water value did not suit. Events on sensor channels other
+  *          than 0 end in "ch<n>".
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "eventlog.h"
+
+static const char *event_names[] = {"boot", "bubble", "cal", "recal", "alarm",
+                                     "comp"};
+
+/**
+  * @brief  Prints one event
+  * @return Nothing
+  */
+static void PrintEvent (uint8_t type, uint32_t time, uint16_t arg)
+{
+    unsigned long value = arg;
+    unsigned ch = 0;
+
+    if(type != LOG_BOOT) {
+        value = LOG_ARG_VALUE(arg);
+        ch = LOG_ARG_CH(arg);
+    }
+    if(type == LOG_BUBBLE) {
+        value *= LOG_UNIT_MS;
+    }
+    if(type < sizeof(event_names) / sizeof(event_names[0])) {
+        printf("%lu,%s %lu", (unsigned long)time, event_names[type], value);
+    } else {
+        printf("%lu,event%u %lu", (unsigned long)time, type, value);
+    }
+    if(ch) {
+        printf(" ch%u", ch);
+    }
+    printf("\n");
+}
+
+int main (void)
+{
+    /* Loads HAL_EEPROM_FILE */
+    HALInit();
+    LogDump(PrintEvent);
+    return 0;
+}
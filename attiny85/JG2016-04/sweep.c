@@ -0,0 +1,616 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/sweep.c
+  * @brief   Replays ADC traces through the detector for every combination
+  *          of the bubble threshold, MAX_AIR, sample rate and filter
+  *          length given, and prints the detection results of each as CSV.
+  *
+  *          usage: sweep [-j jobs] [-R trace rate] [-t tenths] [-a uL]
+  *                       [-r Hz] [-f filter shift] trace...
+  *                 sweep -g seconds [-R trace rate] [-s seed] > trace.bin
+  *                 sweep -c < samples.txt > trace.bin
+  *
+  *          Each option takes a list, e.g. -t 6,7,8 or a range, -t 5:9 or
+  *          -a 500:2000:500, and defaults to the firmware setting. -f needs
+  *          an -DAVG_FILT build and -r one without -DADAPTIVE_RATE.
+  *
+  *          A trace holds little endian 16 bit readings at the trace rate
+  *          (-R, 1000Hz by default), with TRUTH_AIR set on the readings
+  *          where air was really in the tube. -g writes a synthetic trace
+  *          of drifting water readings and random bubbles, and -c converts
+  *          a sample file as main-host reads it, a second number on a line
+  *          other than 0 marking air. Traces are memory mapped and shared
+  *          by every run.
+  *
+  *          The detector keeps its state in globals, so every run is a
+  *          fork of this process calling DetectorMain on a fresh copy, up
+  *          to one per CPU at a time (-j). Each run calibrates from the
+  *          first reading of the trace, so a trace must start in water.
+  *
+  *          A bubble is detected if the detector flags one between its
+  *          first reading and GRACE_MS after its last, and missed
+  *          otherwise. A detection with no bubble in that span is false.
+  *          Latency is from the first air reading to the detection.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "hal.h"
+
+/* Ground truth bit of a trace reading */
+#define TRUTH_AIR       0x8000
+/* Time after a bubble in which its detection still counts */
+#define GRACE_MS        500
+/* Values per option list */
+#define LIST_MAX        64
+
+typedef struct {
+    const uint8_t *data;
+    size_t count;
+    const char *path;
+} trace_t;
+
+typedef struct {
+    uint8_t thresh;
+    uint16_t max_air;
+    uint8_t ticks;
+    uint8_t filt_shift;
+} setting_t;
+
+/* Written by the run, in memory shared with the parent */
+typedef struct {
+    uint32_t bubbles;
+    uint32_t detected;
+    uint32_t missed;
+    uint32_t false_detections;
+    uint64_t latency_total;
+    uint32_t latency_max;
+    int64_t alarm_ms;
+    uint64_t ms;
+    uint8_t done;
+} result_t;
+
+/* Detector state and entry point, see JG2016-04.c */
+extern uint32_t uptime;
+extern uint8_t bubble;
+extern uint8_t alarm_on;
+extern uint8_t thresh_tenths;
+extern uint16_t thresh_q8;
+extern uint8_t sample_ticks;
+extern const uint8_t sweep_min_ticks;
+int DetectorMain (void);
+
+/* Settings read by the detector in a SWEEP build, firmware defaults */
+uint16_t sweep_max_air = 1000;
+uint8_t sweep_filt_shift = 3;
+
+static uint32_t trace_rate = 1000;
+
+/* State of the run in this process */
+static const trace_t *run_trace;
+static result_t *run_result;
+static uint8_t last_bubble;
+static uint32_t last_ms;
+static uint8_t in_air, pending, air_seen;
+static uint32_t air_start, air_end;
+/* Next trace reading to score */
+static uint64_t truth_pos;
+
+/**
+  * @brief  Reads a trace reading
+  * @return Reading with its TRUTH_AIR bit
+  */
+static uint16_t TraceReading (const trace_t *trace, uint64_t i)
+{
+    return trace->data[i * 2] | (trace->data[i * 2 + 1] << 8);
+}
+
+/**
+  * @brief  Tracks the bubbles in the trace from a truth reading
+  * @param  air - non-zero if the reading is air
+  * @param  ms - time of the reading
+  * @return Nothing
+  */
+static void Truth (uint8_t air, uint32_t ms)
+{
+    if(air) {
+        if(!in_air) {
+            in_air = 1;
+            pending = 1;
+            air_seen = 1;
+            air_start = ms;
+            run_result->bubbles++;
+        }
+        air_end = ms;
+    } else {
+        in_air = 0;
+        if(pending && ms > air_end + GRACE_MS) {
+            pending = 0;
+            run_result->missed++;
+        }
+    }
+}
+
+/**
+  * @brief  Counts a bubble flagged by the detector against the truth
+  * @param  ms - time of the reading that flagged it
+  * @return Nothing
+  */
+static void Detection (uint32_t ms)
+{
+    if(pending) {
+        pending = 0;
+        run_result->detected++;
+        run_result->latency_total += ms - air_start;
+        if(ms - air_start > run_result->latency_max) {
+            run_result->latency_max = ms - air_start;
+        }
+    } else if(!in_air && (!air_seen || ms > air_end + GRACE_MS)) {
+        run_result->false_detections++;
+    }
+}
+
+/**
+  * @brief  ADC source of a run. Picks the trace reading for the current
+  *         time, so the detector sees the trace at its own sample rate,
+  *         and scores the detector's response to the readings before
+  *         against every trace reading, sampled or not.
+  * @param  value - next ADC reading
+  * @return 1 if a reading was read, 0 at the end of the trace
+  */
+static int TraceSource (uint16_t *value)
+{
+    uint32_t now = uptime * TICK_MS;
+    uint64_t i = (uint64_t)now * trace_rate / 1000;
+    uint16_t reading;
+
+    if(i >= run_trace->count) {
+        return 0;
+    }
+    reading = TraceReading(run_trace, i);
+
+    /* The detector has seen up to the reading at last_ms */
+    if(bubble && !last_bubble) {
+        Detection(last_ms);
+    }
+    last_bubble = bubble;
+    if(alarm_on && run_result->alarm_ms < 0) {
+        run_result->alarm_ms = last_ms;
+    }
+
+    for(; truth_pos <= i; truth_pos++) {
+        Truth((TraceReading(run_trace, truth_pos) & TRUTH_AIR) != 0,
+              truth_pos * 1000 / trace_rate);
+    }
+    last_ms = now;
+
+    reading &= ~TRUTH_AIR;
+    *value = reading > ADC_MAX ? ADC_MAX : reading;
+    return 1;
+}
+
+/**
+  * @brief  Closes the result once the HAL ends the run at the end of the
+  *         trace
+  * @return Nothing
+  */
+static void RunDone (void)
+{
+    if(pending) {
+        run_result->missed++;
+    }
+    run_result->ms = last_ms;
+    run_result->done = 1;
+}
+
+/**
+  * @brief  Runs the detector over one trace with one setting, in the
+  *         forked process. Does not return.
+  * @return Nothing
+  */
+static void Run (const setting_t *setting, const trace_t *trace,
+                 result_t *result)
+{
+    /* The HAL prints the outputs and a summary */
+    if(!freopen("/dev/null", "w", stdout) ||
+            !freopen("/dev/null", "w", stderr)) {
+        _exit(1);
+    }
+    run_trace = trace;
+    run_result = result;
+    result->alarm_ms = -1;
+
+    thresh_tenths = setting->thresh;
+    /* As TENTHS_Q8 */
+    thresh_q8 = (setting->thresh * 256UL + 5) / 10;
+    sample_ticks = setting->ticks;
+    sweep_max_air = setting->max_air;
+    sweep_filt_shift = setting->filt_shift;
+
+    HALSetADCSource(TraceSource);
+    atexit(RunDone);
+    DetectorMain();
+    _exit(1);
+}
+
+/**
+  * @brief  Parses an option list of values and ranges, e.g. "1,4:6" or
+  *         "100:500:100"
+  * @param  arg - option argument
+  * @param  values - parsed values
+  * @param  max - largest value allowed
+  * @return Number of values, 0 if arg is not a valid list
+  */
+static int ParseList (const char *arg, unsigned long *values,
+                      unsigned long max)
+{
+    unsigned long lo, hi, step;
+    char *end;
+    int count = 0;
+
+    while(*arg) {
+        lo = strtoul(arg, &end, 10);
+        if(end == arg) {
+            return 0;
+        }
+        hi = lo;
+        step = 1;
+        if(*end == ':') {
+            arg = end + 1;
+            hi = strtoul(arg, &end, 10);
+            if(end == arg) {
+                return 0;
+            }
+            if(*end == ':') {
+                arg = end + 1;
+                step = strtoul(arg, &end, 10);
+                if(end == arg || step == 0) {
+                    return 0;
+                }
+            }
+        }
+        if(hi > max) {
+            return 0;
+        }
+        for(; lo <= hi; lo += step) {
+            if(count == LIST_MAX) {
+                return 0;
+            }
+            values[count++] = lo;
+        }
+        if(*end == ',') {
+            end++;
+        } else if(*end) {
+            return 0;
+        }
+        arg = end;
+    }
+    return count;
+}
+
+/**
+  * @brief  Writes a trace reading to stdout
+  * @return Nothing
+  */
+static void PutReading (uint16_t reading)
+{
+    putchar(reading & 0xFF);
+    putchar(reading >> 8);
+}
+
+/**
+  * @brief  Next pseudo random number, xorshift32
+  * @return Random number
+  */
+static uint32_t Random (uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+  * @brief  Writes a synthetic trace: water readings drifting down by a
+  *         quarter over the trace with noise, and bubbles of 5ms to 500ms
+  *         every 2s to 20s reading at about a third of the water value
+  * @param  seconds - trace length
+  * @param  seed - random seed
+  * @return Nothing
+  */
+static void Generate (unsigned long seconds, uint32_t seed)
+{
+    uint64_t i, count = (uint64_t)seconds * trace_rate;
+    uint64_t next = trace_rate * 2, length = 0;
+    uint32_t state = seed ? seed : 1;
+    int32_t water, level;
+
+    for(i = 0; i < count; i++) {
+        water = (ADC_MAX * 4 / 5) - (int64_t)(ADC_MAX / 5) * i / count;
+        if(i == next) {
+            length = (5 + Random(&state) % 496) * trace_rate / 1000 + 1;
+            next = i + length + (2 + Random(&state) % 19) * trace_rate;
+        }
+        level = length ? water / 3 : water;
+        level += (int32_t)(Random(&state) % (ADC_MAX / 64 + 1)) -
+                 ADC_MAX / 128;
+        level = level < 0 ? 0 : level > ADC_MAX ? ADC_MAX : level;
+        PutReading(level | (length ? TRUTH_AIR : 0));
+        if(length) {
+            length--;
+        }
+    }
+}
+
+/**
+  * @brief  Converts a sample file on stdin to a trace on stdout
+  * @return Nothing
+  */
+static void Convert (void)
+{
+    char line[64];
+    char *end, *start;
+    unsigned long reading, air;
+
+    while(fgets(line, sizeof(line), stdin)) {
+        reading = strtoul(line, &end, 10);
+        if(end == line) {
+            continue;
+        }
+        start = end;
+        air = strtoul(start, &end, 10);
+        if(reading > ADC_MAX) {
+            reading = ADC_MAX;
+        }
+        PutReading(reading | (end != start && air ? TRUTH_AIR : 0));
+    }
+}
+
+/**
+  * @brief  Maps a trace file
+  * @return 0 on error
+  */
+static int TraceOpen (trace_t *trace, const char *path)
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return 0;
+    }
+    if(st.st_size < 2) {
+        fprintf(stderr, "%s: empty trace\n", path);
+        return 0;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        perror(path);
+        return 0;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    trace->data = data;
+    trace->count = st.st_size / 2;
+    trace->path = path;
+    return 1;
+}
+
+/**
+  * @brief  Prints the results of a setting summed over every trace
+  * @return Nothing
+  */
+static void PrintResult (const setting_t *setting, const result_t *results,
+                         int traces)
+{
+    result_t sum;
+    double hours;
+    unsigned length = 1;
+    int i;
+
+    memset(&sum, 0, sizeof(sum));
+    sum.alarm_ms = -1;
+    for(i = 0; i < traces; i++) {
+        sum.bubbles += results[i].bubbles;
+        sum.detected += results[i].detected;
+        sum.missed += results[i].missed;
+        sum.false_detections += results[i].false_detections;
+        sum.latency_total += results[i].latency_total;
+        if(results[i].latency_max > sum.latency_max) {
+            sum.latency_max = results[i].latency_max;
+        }
+        if(results[i].alarm_ms >= 0 &&
+                (sum.alarm_ms < 0 || results[i].alarm_ms < sum.alarm_ms)) {
+            sum.alarm_ms = results[i].alarm_ms;
+        }
+        sum.ms += results[i].ms;
+    }
+    hours = sum.ms / 3600000.0;
+#ifdef AVG_FILT
+    length = 1 << setting->filt_shift;
+#endif
+    printf("%u,%u,%u,%u,%lu,%lu,%lu,%lu,%.4f,%.2f,%.1f,%lu,%lld\n",
+           setting->thresh, setting->max_air,
+           1000 / (setting->ticks * TICK_MS), length,
+           (unsigned long)sum.bubbles, (unsigned long)sum.detected,
+           (unsigned long)sum.missed, (unsigned long)sum.false_detections,
+           sum.bubbles ? (double)sum.missed / sum.bubbles : 0.0,
+           hours > 0 ? sum.false_detections / hours : 0.0,
+           sum.detected ? (double)sum.latency_total / sum.detected : 0.0,
+           (unsigned long)sum.latency_max, (long long)sum.alarm_ms);
+}
+
+static void Usage (const char *name)
+{
+    fprintf(stderr, "usage: %s [-j jobs] [-R trace rate] [-t tenths] "
+            "[-a uL] [-r Hz] [-f filter shift] trace...\n"
+            "       %s -g seconds [-R trace rate] [-s seed] > trace.bin\n"
+            "       %s -c < samples.txt > trace.bin\n", name, name, name);
+    exit(2);
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned long thresh[LIST_MAX], max_air[LIST_MAX], rate[LIST_MAX];
+    unsigned long filt[LIST_MAX];
+    int n_thresh = 1, n_max_air = 1, n_rate = 1, n_filt = 1;
+    unsigned long generate = 0, seed = 1;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    trace_t *traces;
+    setting_t *settings;
+    result_t *results;
+    int n_traces, n_settings, n_runs, next = 0, running = 0, failed = 0;
+    int opt, i, a, t, r, f;
+
+    thresh[0] = thresh_tenths;
+    max_air[0] = sweep_max_air;
+    rate[0] = 1000 / (sample_ticks * TICK_MS);
+    filt[0] = sweep_filt_shift;
+
+    while((opt = getopt(argc, argv, "j:R:t:a:r:f:g:s:c")) != -1) {
+        switch(opt) {
+        case 'j':
+            jobs = atol(optarg);
+            break;
+        case 'R':
+            trace_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            n_thresh = ParseList(optarg, thresh, 9);
+            break;
+        case 'a':
+            n_max_air = ParseList(optarg, max_air, 65535);
+            break;
+        case 'r':
+            n_rate = ParseList(optarg, rate, 1000 / TICK_MS);
+#ifdef ADAPTIVE_RATE
+            fprintf(stderr, "-r needs a build without -DADAPTIVE_RATE\n");
+            return 2;
+#endif
+            break;
+        case 'f':
+            n_filt = ParseList(optarg, filt, 16 - ADC_BITS);
+#ifndef AVG_FILT
+            fprintf(stderr, "-f needs a -DAVG_FILT build\n");
+            return 2;
+#endif
+            break;
+        case 'g':
+            generate = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            Convert();
+            return 0;
+        default:
+            Usage(argv[0]);
+        }
+    }
+    if(!n_thresh || !n_max_air || !n_rate || !n_filt || jobs < 1 ||
+            trace_rate == 0) {
+        Usage(argv[0]);
+    }
+    if(generate) {
+        Generate(generate, seed);
+        return 0;
+    }
+    n_traces = argc - optind;
+    if(n_traces < 1) {
+        Usage(argv[0]);
+    }
+
+    traces = calloc(n_traces, sizeof(*traces));
+    n_settings = n_thresh * n_max_air * n_rate * n_filt;
+    settings = calloc(n_settings, sizeof(*settings));
+    if(!traces || !settings) {
+        perror("sweep");
+        return 1;
+    }
+    for(i = 0; i < n_traces; i++) {
+        if(!TraceOpen(&traces[i], argv[optind + i])) {
+            return 1;
+        }
+    }
+    i = 0;
+    for(t = 0; t < n_thresh; t++) {
+        for(a = 0; a < n_max_air; a++) {
+            for(r = 0; r < n_rate; r++) {
+                for(f = 0; f < n_filt; f++) {
+                    if(thresh[t] < 1 || rate[r] < 1 ||
+                            1000 / rate[r] / TICK_MS < sweep_min_ticks ||
+                            1000 / rate[r] / TICK_MS > 255) {
+                        fprintf(stderr, "%lu tenths at %luHz is out of "
+                                "range\n", thresh[t], rate[r]);
+                        return 2;
+                    }
+                    settings[i].thresh = thresh[t];
+                    settings[i].max_air = max_air[a];
+                    settings[i].ticks = 1000 / rate[r] / TICK_MS;
+                    settings[i].filt_shift = filt[f];
+                    i++;
+                }
+            }
+        }
+    }
+
+    /* One result per setting and trace, written by the runs */
+    n_runs = n_settings * n_traces;
+    results = mmap(NULL, n_runs * sizeof(*results), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(results == MAP_FAILED) {
+        perror("sweep");
+        return 1;
+    }
+    memset(results, 0, n_runs * sizeof(*results));
+    /* Every run calibrates from its trace and keeps its output to itself */
+    unsetenv("HAL_EEPROM_FILE");
+    unsetenv("HAL_SERIAL_FILE");
+    fflush(stdout);
+
+    while(next < n_runs || running) {
+        if(next < n_runs && running < jobs) {
+            pid_t pid = fork();
+
+            if(pid == 0) {
+                Run(&settings[next / n_traces], &traces[next % n_traces],
+                    &results[next]);
+            }
+            if(pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            next++;
+            running++;
+            continue;
+        }
+        if(wait(NULL) > 0) {
+            running--;
+        }
+    }
+
+    printf("thresh,max_air,rate,filter,bubbles,detected,missed,false,"
+           "miss_rate,false_per_hour,latency_ms,latency_max_ms,alarm_ms\n");
+    for(i = 0; i < n_settings; i++) {
+        for(t = 0; t < n_traces; t++) {
+            if(!results[i * n_traces + t].done) {
+                fprintf(stderr, "%s: run failed\n", traces[t].path);
+                failed = 1;
+            }
+        }
+        PrintResult(&settings[i], &results[i * n_traces], n_traces);
+    }
+    return failed;
+}
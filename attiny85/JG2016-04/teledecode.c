@@ -0,0 +1,335 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/teledecode.c
+  * @brief   Decodes the -DTELEMETRY stream, see telemetry.h, into one line
+  *          of "ms,raw,filtered" per reading, or with -b into little endian
+  *          records of ms (32 bits), raw and filtered (16 bits each). With
+  *          more than one sensor channel each line or record holds the raw
+  *          and filtered pair of every channel in turn. Profiling packets
+  *          from a -DPROFILE build are printed to stderr.
+  *
+  *          usage: teledecode [-b] [capture file or serial port]
+  *
+  *          Reads stdin when no path is given. A serial port is set to raw
+  *          mode at SERIAL_BAUD. Packets with a bad checksum are skipped,
+  *          and the packet, reading, dropped and bad totals are printed to
+  *          stderr at the end, e.g.
+  *
+  *          HAL_SERIAL_FILE=stream.bin ./main-host < samples.txt
+  *          ./teledecode stream.bin
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "hal.h"
+#include "telemetry.h"
+
+/* Longer than any valid packet */
+#define PACKET_MAX      128
+/* Channels a packet can hold */
+#define CHANNELS_MAX    8
+
+#if SERIAL_BAUD == 2400
+#define SERIAL_SPEED    B2400
+#elif SERIAL_BAUD == 4800
+#define SERIAL_SPEED    B4800
+#elif SERIAL_BAUD == 9600
+#define SERIAL_SPEED    B9600
+#else
+#error "No termios speed for SERIAL_BAUD"
+#endif
+
+static int binary;
+static int channels;
+static int have_seq;
+static uint8_t next_seq;
+static unsigned long packets, readings, dropped, bad;
+
+/**
+  * @brief  Decodes a varint
+  * @param  data - encoded value
+  * @param  max - bytes available
+  * @param  value - decoded value
+  * @return Number of bytes read, 0 if the varint runs past max
+  */
+static int GetVarint (const uint8_t *data, int max, uint32_t *value)
+{
+    int len = 0, shift = 0;
+
+    *value = 0;
+    while(len < max && shift < 32) {
+        *value |= (uint32_t)(data[len] & 0x7F) << shift;
+        if(!(data[len++] & 0x80)) {
+            return len;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+/**
+  * @brief  Undoes the zigzag mapping
+  * @return Signed value
+  */
+static int32_t Unzigzag (uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/**
+  * @brief  Prints the CSV header for the channel count
+  * @return Nothing
+  */
+static void PrintHeader (int count)
+{
+    int ch;
+
+    printf("ms");
+    for(ch = 0; ch < count; ch++) {
+        if(count == 1) {
+            printf(",raw,filtered");
+        } else {
+            printf(",raw%d,filtered%d", ch, ch);
+        }
+    }
+    printf("\n");
+}
+
+/**
+  * @brief  Prints one reading as CSV or a binary record
+  * @return Nothing
+  */
+static void PrintReading (uint32_t ms, const uint16_t *raw,
+                          const uint16_t *filtered, int count)
+{
+    uint8_t record[4 + CHANNELS_MAX * 4];
+    int ch, len = 4;
+
+    if(binary) {
+        record[0] = ms;
+        record[1] = ms >> 8;
+        record[2] = ms >> 16;
+        record[3] = ms >> 24;
+        for(ch = 0; ch < count; ch++) {
+            record[len++] = raw[ch];
+            record[len++] = raw[ch] >> 8;
+            record[len++] = filtered[ch];
+            record[len++] = filtered[ch] >> 8;
+        }
+        fwrite(record, 1, len, stdout);
+    } else {
+        printf("%lu", (unsigned long)ms);
+        for(ch = 0; ch < count; ch++) {
+            printf(",%u,%u", raw[ch], filtered[ch]);
+        }
+        printf("\n");
+    }
+    readings++;
+}
+
+/**
+  * @brief  Prints the profiling counters from a packet with no channels
+  * @param  data - counters, after the channels byte
+  * @param  len - bytes available
+  * @param  time - ticks since boot when the counters were read
+  * @param  ticks - ticks the counters cover
+  * @return 0 if the packet is short
+  */
+static int PrintProfile (const uint8_t *data, int len, uint32_t time,
+                         uint32_t ticks)
+{
+    static const char *isr_names[PROF_ISRS] = {
+        "tick", "pcint", "adc", "eeprom", "usi"
+    };
+    uint32_t value[4 + PROF_ISRS * 2];
+    double span;
+    int pos = 0, n, i;
+
+    for(i = 0; i < 4 + PROF_ISRS * 2; i++) {
+        n = GetVarint(&data[pos], len - pos, &value[i]);
+        if(n == 0) {
+            return 0;
+        }
+        pos += n;
+    }
+    if(ticks == 0) {
+        return 1;
+    }
+    /* value: count_us, awake, awake_max, conversions, then calls and counts
+     * per interrupt */
+    span = (double)ticks * TICK_MS * 1000;
+    fprintf(stderr, "profile %lu: %lu ticks, %.1f conversions/s",
+            (unsigned long)time * TICK_MS, (unsigned long)ticks,
+            value[3] * 1e6 / span);
+    if(value[0]) {
+        fprintf(stderr, ", awake %.1f%%, longest %luus",
+                (double)value[1] * value[0] * 100.0 / span,
+                (unsigned long)value[2] * value[0]);
+    }
+    for(i = 0; i < PROF_ISRS; i++) {
+        fprintf(stderr, ", %s %lu", isr_names[i],
+                (unsigned long)value[4 + i * 2]);
+        if(value[0]) {
+            fprintf(stderr, " %.2f%%",
+                    (double)value[5 + i * 2] * value[0] * 100.0 / span);
+        }
+    }
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+/**
+  * @brief  Checks and decodes a packet with its framing removed
+  * @return Nothing
+  */
+static void DecodePacket (const uint8_t *packet, int len)
+{
+    uint32_t time, period, value;
+    int32_t last[CHANNELS_MAX] = {0};
+    uint16_t raw[CHANNELS_MAX], filtered[CHANNELS_MAX];
+    uint8_t sum = 0;
+    int pos, n, i, ch, count;
+
+    for(i = 0; i < len - 1; i++) {
+        sum += packet[i];
+    }
+    if(len < 6 || sum != packet[len - 1]) {
+        bad++;
+        return;
+    }
+    /* Checksum off the end */
+    len--;
+
+    if(have_seq && packet[0] != next_seq) {
+        dropped += (uint8_t)(packet[0] - next_seq);
+    }
+    have_seq = 1;
+    next_seq = packet[0] + 1;
+
+    pos = 1;
+    n = GetVarint(&packet[pos], len - pos, &time);
+    pos += n;
+    if(n == 0 || (n = GetVarint(&packet[pos], len - pos, &period)) == 0) {
+        bad++;
+        return;
+    }
+    pos += n;
+    if(pos < len && packet[pos] == 0) {
+        /* Profiling counters, period holds the ticks they cover */
+        pos++;
+        if(PrintProfile(&packet[pos], len - pos, time, period)) {
+            packets++;
+        } else {
+            bad++;
+        }
+        return;
+    }
+    count = pos < len ? packet[pos++] : 0;
+    if(count < 1 || count > CHANNELS_MAX) {
+        bad++;
+        return;
+    }
+    if(count != channels) {
+        channels = count;
+        if(!binary) {
+            PrintHeader(count);
+        }
+    }
+    packets++;
+
+    for(i = 0; pos < len; i++) {
+        for(ch = 0; ch < count; ch++) {
+            n = GetVarint(&packet[pos], len - pos, &value);
+            if(n == 0) {
+                bad++;
+                return;
+            }
+            pos += n;
+            last[ch] += Unzigzag(value);
+            raw[ch] = last[ch];
+            n = GetVarint(&packet[pos], len - pos, &value);
+            if(n == 0) {
+                bad++;
+                return;
+            }
+            pos += n;
+            filtered[ch] = last[ch] + Unzigzag(value);
+        }
+        PrintReading((time + i * period) * TICK_MS, raw, filtered, count);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    uint8_t packet[PACKET_MAX], buf[256];
+    struct termios tio;
+    int fd = 0, i, n, len = 0, escaped = 0, overrun = 0;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "-b")) {
+            binary = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-b] [file or serial port]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if(i < argc) {
+        fd = open(argv[i], O_RDONLY | O_NOCTTY);
+        if(fd < 0) {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+    if(isatty(fd)) {
+        if(tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            cfsetispeed(&tio, SERIAL_SPEED);
+            cfsetospeed(&tio, SERIAL_SPEED);
+            tio.c_cflag |= CLOCAL | CREAD;
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+    }
+    /* SLIP decode, a packet ends at each TELEM_END */
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        for(i = 0; i < n; i++) {
+            if(buf[i] == TELEM_END) {
+                if(overrun) {
+                    bad++;
+                } else if(len) {
+                    DecodePacket(packet, len);
+                }
+                len = 0;
+                escaped = 0;
+                overrun = 0;
+                continue;
+            }
+            if(buf[i] == TELEM_ESC) {
+                escaped = 1;
+                continue;
+            }
+            if(escaped) {
+                escaped = 0;
+                buf[i] = buf[i] == TELEM_ESC_END ? TELEM_END :
+                         buf[i] == TELEM_ESC_ESC ? TELEM_ESC : buf[i];
+            }
+            if(len < PACKET_MAX) {
+                packet[len++] = buf[i];
+            } else {
+                overrun = 1;
+            }
+        }
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "%lu packets, %lu readings, %lu dropped, %lu bad\n",
+            packets, readings, dropped, bad);
+    return 0;
+}
@@ -0,0 +1,170 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/telemetry.c
+  * @brief   Raw sample telemetry. Readings are delta and varint packed into
+  *          a packet in SRAM, see telemetry.h for the format, and the
+  *          finished packet is queued on the interrupt driven serial output
+  *          so the detector never waits for the link. At 2400 baud a packet
+  *          of 8 steady readings takes ~0.1s to send against 0.4s to fill.
+  *          Only built with -DTELEMETRY.
+  ******************************************************************************
+  */
+
+#include <stdint.h>
+
+#include "hal.h"
+#include "telemetry.h"
+
+#ifdef TELEMETRY
+
+/* Sequence number, time (5 bytes), period (2 bytes), channels, TELEM_SAMPLES
+ * readings of up to 4 bytes per channel and the checksum */
+#define TELEM_SAMPLES_MAX (1 + 5 + 2 + 1 + TELEM_SAMPLES * ADC_CHANNELS * 4 + 1)
+#ifdef PROFILE
+/* Sequence number, time and ticks (5 bytes each), channels, count_us (3
+ * bytes), 3 32 bit and 1 16 bit counter, a 16 and 32 bit counter per
+ * interrupt and the checksum */
+#define TELEM_PROFILE_MAX (1 + 5 + 5 + 1 + 3 + 3 * 5 + 3 + PROF_ISRS * 8 + 1)
+#else
+#define TELEM_PROFILE_MAX 0
+#endif
+#define TELEM_PACKET_MAX (TELEM_SAMPLES_MAX > TELEM_PROFILE_MAX ? \
+                          TELEM_SAMPLES_MAX : TELEM_PROFILE_MAX)
+#define ZIGZAG(x)       ((uint16_t)((uint16_t)(x) << 1) ^ (uint16_t)((x) >> 15))
+
+/* Packet being filled */
+uint8_t telem_packet[TELEM_PACKET_MAX];
+uint8_t telem_len;
+uint8_t telem_count;
+uint8_t telem_period;
+uint8_t telem_seq;
+/* Previous raw reading of each channel in the packet */
+uint16_t telem_raw[ADC_CHANNELS];
+/* Channel the next sample is for, non-zero part way through a reading */
+uint8_t telem_ch;
+
+/**
+  * @brief  Appends a varint to the packet
+  * @param  value - value to append
+  * @return Nothing
+  */
+void TelemPutVarint (uint32_t value)
+{
+    while(value > 0x7F) {
+        telem_packet[telem_len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    telem_packet[telem_len++] = value;
+}
+
+/**
+  * @brief  Queues the packet on the serial output with SLIP framing, or
+  *         drops it if the serial buffer can not take all of it
+  * @return Nothing
+  */
+void TelemSend (void)
+{
+    uint8_t i, sum = 0, len = 2;
+
+    for(i = 0; i < telem_len; i++) {
+        sum += telem_packet[i];
+    }
+    telem_packet[telem_len++] = sum;
+
+    /* Framed length, with TELEM_END at both ends */
+    for(i = 0; i < telem_len; i++) {
+        len += (telem_packet[i] == TELEM_END ||
+                telem_packet[i] == TELEM_ESC) ? 2 : 1;
+    }
+    if(SerialFree() >= len) {
+        SerialPut(TELEM_END);
+        for(i = 0; i < telem_len; i++) {
+            if(telem_packet[i] == TELEM_END) {
+                SerialPut(TELEM_ESC);
+                SerialPut(TELEM_ESC_END);
+            } else if(telem_packet[i] == TELEM_ESC) {
+                SerialPut(TELEM_ESC);
+                SerialPut(TELEM_ESC_ESC);
+            } else {
+                SerialPut(telem_packet[i]);
+            }
+        }
+        SerialPut(TELEM_END);
+    }
+
+    /* The sequence number still counts a dropped packet */
+    telem_seq++;
+    telem_count = 0;
+}
+
+void TelemetryInit (void)
+{
+    SerialInit();
+}
+
+void TelemetrySample (uint32_t time, uint8_t period, uint8_t ch,
+                      uint16_t raw, uint16_t filtered)
+{
+    int16_t delta;
+    uint8_t i;
+
+    if(ch == 0 && telem_count && period != telem_period) {
+        TelemSend();
+    }
+    if(ch == 0 && telem_count == 0) {
+        telem_len = 0;
+        telem_packet[telem_len++] = telem_seq;
+        TelemPutVarint(time);
+        TelemPutVarint(period);
+        telem_packet[telem_len++] = ADC_CHANNELS;
+        telem_period = period;
+        for(i = 0; i < ADC_CHANNELS; i++) {
+            telem_raw[i] = 0;
+        }
+    }
+
+    delta = raw - telem_raw[ch];
+    TelemPutVarint(ZIGZAG(delta));
+    delta = filtered - raw;
+    TelemPutVarint(ZIGZAG(delta));
+    telem_raw[ch] = raw;
+    telem_ch = ch == ADC_CHANNELS - 1 ? 0 : ch + 1;
+
+    if(ch == ADC_CHANNELS - 1 && ++telem_count == TELEM_SAMPLES) {
+        TelemSend();
+    }
+}
+
+#ifdef PROFILE
+uint8_t TelemetryProfile (uint32_t time)
+{
+    profile_t prof;
+    uint8_t i;
+
+    /* The packets go out back to back, which only fits an empty buffer */
+    if(telem_ch || SerialFree() < SERIAL_BUF_SIZE - 1) {
+        return 0;
+    }
+    if(telem_count) {
+        TelemSend();
+    }
+
+    ProfileGet(&prof);
+    telem_len = 0;
+    telem_packet[telem_len++] = telem_seq;
+    TelemPutVarint(time);
+    TelemPutVarint(prof.ticks);
+    telem_packet[telem_len++] = 0;
+    TelemPutVarint(prof.count_us);
+    TelemPutVarint(prof.awake);
+    TelemPutVarint(prof.awake_max);
+    TelemPutVarint(prof.conversions);
+    for(i = 0; i < PROF_ISRS; i++) {
+        TelemPutVarint(prof.isr_calls[i]);
+        TelemPutVarint(prof.isr_counts[i]);
+    }
+    TelemSend();
+    return 1;
+}
+#endif
+#endif
@@ -0,0 +1,83 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/JG2016-04/telemetry.h
+  * @brief   Raw sample telemetry, built with -DTELEMETRY. Every reading and
+  *          its filtered value are packed into packets sent on the serial
+  *          output, see teledecode.c for the host side.
+  *
+  *          Packets are SLIP framed: each starts and ends with TELEM_END,
+  *          and TELEM_END or TELEM_ESC inside a packet are sent as TELEM_ESC
+  *          followed by TELEM_ESC_END or TELEM_ESC_ESC. A packet holds
+  *
+  *          sequence number     1 byte, counts every packet including those
+  *                              dropped while the serial buffer was full
+  *          time                varint, ticks since boot of the first reading
+  *          period              varint, ticks between readings
+  *          channels            1 byte, sensor channels per reading
+  *          readings            per reading and channel: zigzag varint of
+  *                              the raw value minus the channel's previous
+  *                              raw value (0 for the first), then zigzag
+  *                              varint of the filtered value minus the raw
+  *                              value
+  *          checksum            1 byte, sum of the bytes above
+  *
+  *          With -DPROFILE a packet with 0 channels carries the profiling
+  *          counters instead, see TelemetryProfile: the sequence number,
+  *          time, ticks covered (varint) and 0, then varints of count_us,
+  *          awake, awake_max, conversions and the calls and counts of each
+  *          of the PROF_ISRS interrupts, then the checksum.
+  *
+  *          Varints hold 7 bits per byte, low bits first, with the top bit
+  *          set on all but the last byte. Zigzag maps 0, -1, 1, -2... to
+  *          0, 1, 2, 3... so small changes of either sign take one byte.
+  ******************************************************************************
+  */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+#include "hal.h"
+
+/* Readings (scans of every channel) per packet, a packet is sent early when
+ * the period changes */
+#define TELEM_SAMPLES   (8 / ADC_CHANNELS)
+
+#define TELEM_END       0xC0
+#define TELEM_ESC       0xDB
+#define TELEM_ESC_END   0xDC
+#define TELEM_ESC_ESC   0xDD
+
+/**
+  * @brief  Starts the serial output
+  * @return Nothing
+  */
+void TelemetryInit (void);
+
+/**
+  * @brief  Adds a reading to the current packet, sending it once full. A
+  *         packet that does not fit the serial buffer is dropped. Channels
+  *         must be added in order, channel 0 starting each reading.
+  * @param  time - ticks since boot
+  * @param  period - ticks since the previous reading
+  * @param  ch - sensor channel
+  * @param  raw - reading from the ADC
+  * @param  filtered - reading after filtering
+  * @return Nothing
+  */
+void TelemetrySample (uint32_t time, uint8_t period, uint8_t ch,
+                      uint16_t raw, uint16_t filtered);
+
+#ifdef PROFILE
+/**
+  * @brief  Once the serial output has drained, sends any readings in the
+  *         current packet and then the profiling counters in a packet of
+  *         their own, restarting the counters
+  * @param  time - ticks since boot
+  * @return 1 if the counters were sent, 0 if the serial output is busy
+  */
+uint8_t TelemetryProfile (uint32_t time);
+#endif
+
+#endif /* TELEMETRY_H */
@@ -1,80 +1,54 @@
 // adc.c
 //
 // Example ADC program for ATtiny85
-// on pin 2 (PB3)
-// Blinks LED if ADC is greater than 512
+// Samples ADC2 (PB4) at ADC_QUEUE_HZ through the ADC sample queue
+// Lights B0 for 200ms each time the reading reaches a new peak
+// and blinks the LED on B3
 //
-#define F_CPU 8000000UL
-
-#include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
 #include <stdint.h>
 
+#include "tiny85.h"
+#include "adc.h"
+#include "led.h"
 
-volatile uint8_t ref = 0;
-
-void ADCInit (void)
-{
-	// Setup ADMUX register
-	ADMUX = (0 << REFS2) | (1 << REFS1) | (0 << REFS0); // Set reference voltage to internal 1.1V
-	ADMUX |= (1 << ADLAR); // Left adjust bits (8 bit mode)
-	// Select PB4 (ADC2) with single ended input
-	ADMUX |= (0 << MUX3) | (0 << MUX2) | (1 << MUX1) | (0 << MUX0); 
-	
-	ADCSRA = (1 << ADEN); // Enable ADC
-    ADCSRA |= (0 << ADATE); // Auto trigger disabled
-    ADCSRA |= (1 << ADIE); // Interrupt enabled
-	// Recommended ADC clock is between 50kHz and 200kHz
-	// If using internal 8MHz clock, prescaler must be 128 or 64
-	ADCSRA |= (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0); // Prescaler of 128
-}	
-
-void BlinkLED (void)
-{
-    // Set B3 high
-    PORTB |= (1 << PORTB3);
-    _delay_ms(200);
-    
-    // Set B3 low
-    PORTB &= ~(1 << PORTB3);
-    _delay_ms(200);
-}
-    
+// Samples drained from the queue at a time
+#define BATCH           8
+// How long B0 stays lit after a new peak, in samples
+#define HOLD_SAMPLES    (200 * ADC_QUEUE_HZ / 1000)
 
 int main (void)
 {
-    // Set clock prescaler to 8 (1MHz clock speed)
-    //CLKPR = (1 << CLKPCE) | (0 << CLKPS3) | (0 << CLKPS2) | (0 << CLKPS1) | (0 << CLKPS0);
-    //CLKPR = (0 << CLKPCE) | (0 << CLKPS3) | (0 << CLKPS2) | (1 << CLKPS1) | (1 << CLKPS0);    
-    
-    // Set B3 to output
+    adc_sample_t samples[BATCH];
+    uint16_t hold_until = 0;
+    uint8_t ref = 0, held = 0;
+    uint8_t detected, count, i;
+
+    // Set B3 and B0 to output
 	DDRB = (1 << DDB3) | (1 << DDB0);
     ADCInit();
+    ADCStart();
     sei(); // Enable interrupts
-    ADCSRA |= (1 << ADSC); 
 	while(1) {
+        // The conversions taken while blinking wait in the queue
         BlinkLED();
+        while((count = ADCRead(samples, BATCH)) > 0) {
+            for(i = 0; i < count; i++) {
+                detected = samples[i].value >> 8;
+                // Set B0 high if ADC is more than reference level
+                if(detected > ref) {
+                    ref = detected;
+                    PORTB |= (1 << PORTB0);
+                    hold_until = samples[i].time + HOLD_SAMPLES;
+                    held = 1;
+                } else if(held &&
+                          (int16_t)(samples[i].time - hold_until) >= 0) {
+                    PORTB &= ~(1 << PORTB0);
+                    held = 0;
+                }
+            }
+        }
 	}
 	
 	return 0;
 }
-
-ISR(ADC_vect)
-{
-    uint8_t detected;
-    detected = ADCH;
-    // Set B0 high if ADC is more than reference level
-    if(detected > ref) {
-        ref = detected;
-        PORTB |= (1 << PORTB0);
-        _delay_ms(200);
-
-    } else {
-        //ref--;
-        PORTB &= ~(1 << PORTB0);
-    }
-    
-    ADCSRA |= (1 << ADSC); // Restart the conversion
-}
-    
\ No newline at end of file
@@ -0,0 +1,273 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/bench/bench.c
+  * @brief   simavr benchmark harness for the ATtiny85 firmware. Runs each
+  *          main.elf against a scripted ADC waveform and prints one CSV row
+  *          per target with cycle, sleep, latency and memory figures.
+  *
+  *          usage: bench [-t seconds] [-w level:bubble:period:width]
+  *                       [-f hz] dir/main.elf ...
+  *
+  *          The waveform holds the ADC inputs at "level" mV and drops (or
+  *          rises) to "bubble" mV for "width" ms every "period" ms. Latency is
+  *          measured from each bubble onset to the next rising edge on PB0 or
+  *          PB1. cycles_per_sample is the awake cycle count divided by the
+  *          number of ADC conversions started.
+  *
+  *          The core starts at the -f oscillator frequency, as with the
+  *          CKDIV8 fuse unprogrammed, and every CLKPR write divides it down
+  *          from then on. simavr counts cycles only, so times are summed per
+  *          clock setting and the simulated frequency is updated with it.
+  *          Firmware that switches its clock at run time, e.g. JG2016-04's
+  *          CLOCK_FAST bursts, is timed correctly. hz is the oscillator
+  *          frequency and sleep_fraction a fraction of time, not cycles.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <libgen.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_adc.h"
+#include "avr_ioport.h"
+
+/* Default waveform: water reads ~800 counts, air ~300 against the 1V1 ref */
+#define LEVEL_MV        860
+#define BUBBLE_MV       320
+#define BUBBLE_PERIOD   2000
+#define BUBBLE_WIDTH    300
+#define RUN_SECONDS     30
+/* Internal RC oscillator, divided by CLKPR */
+#define DEFAULT_HZ      8000000
+/* CLKPR data space address and its change enable bit */
+#define CLKPR_ADDR      0x46
+#define CLKPR_CLKPCE    0x80
+
+/* Measurements for the target being run */
+typedef struct {
+    uint32_t osc_hz;        /* clock before the CLKPR divide */
+    uint64_t clock_cycle;   /* cycle of the last clock change */
+    double clock_time;      /* seconds simulated up to it */
+    uint8_t clock_enable;   /* CLKPCE written, the next write sets CLKPS */
+    uint64_t sleep_cycles;
+    double sleep_time;
+    uint32_t conversions;
+    double onset_time;      /* time of the last bubble onset */
+    uint8_t waiting;        /* onset seen, no alarm edge yet */
+    double worst_latency;   /* in seconds */
+    uint32_t onsets;
+    uint32_t misses;
+} bench_t;
+
+static bench_t bench;
+
+/**
+  * @brief  Converts the cycle count to simulated time at the clock settings
+  *         it ran at
+  * @return Seconds since reset
+  */
+static double SimTime (avr_t *avr)
+{
+    return bench.clock_time +
+           (double)(avr->cycle - bench.clock_cycle) / avr->frequency;
+}
+
+/**
+  * @brief  CLKPR write, changes the simulated clock once CLKPCE has been set
+  *         on the write before
+  * @return Nothing
+  */
+static void ClockWrite (struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+                        void *param)
+{
+    avr->data[addr] = v;
+    if(v & CLKPR_CLKPCE) {
+        bench.clock_enable = 1;
+        return;
+    }
+    if(!bench.clock_enable) {
+        return;
+    }
+    bench.clock_enable = 0;
+    bench.clock_time = SimTime(avr);
+    bench.clock_cycle = avr->cycle;
+    avr->frequency = bench.osc_hz >> ((v & 0x0F) > 8 ? 8 : (v & 0x0F));
+}
+
+/**
+  * @brief  ADC conversion start notification, counts conversions
+  * @return Nothing
+  */
+static void ADCTrigger (struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    bench.conversions++;
+}
+
+/**
+  * @brief  PB0/PB1 change notification, closes the latency measurement for
+  *         the current bubble on the first rising edge
+  * @return Nothing
+  */
+static void PinChange (struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    avr_t *avr = param;
+    double latency;
+
+    if(value && bench.waiting) {
+        latency = SimTime(avr) - bench.onset_time;
+        if(latency > bench.worst_latency) {
+            bench.worst_latency = latency;
+        }
+        bench.waiting = 0;
+    }
+}
+
+/**
+  * @brief  Runs one firmware image and prints its CSV row
+  * @return 0 on success, -1 if the image could not be loaded
+  */
+static int RunTarget (const char *path, double seconds, uint32_t hz,
+                      uint16_t level, uint16_t bubble, uint32_t period,
+                      uint32_t width)
+{
+    elf_firmware_t f;
+    avr_t *avr;
+    avr_irq_t *adc[3];
+    uint64_t before, ms;
+    double start;
+    uint16_t mv, last_mv = 0xFFFF;
+    uint8_t in_bubble = 0, sleeping;
+    int state, i;
+    char name[256];
+
+    memset(&f, 0, sizeof(f));
+    memset(&bench, 0, sizeof(bench));
+    bench.osc_hz = hz;
+    if(elf_read_firmware(path, &f) != 0) {
+        fprintf(stderr, "%s: could not read firmware\n", path);
+        return -1;
+    }
+    avr = avr_make_mcu_by_name("attiny85");
+    if(!avr) {
+        fprintf(stderr, "simavr has no attiny85 core\n");
+        exit(1);
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &f);
+    avr->frequency = hz;
+    avr->log = 0;
+
+    /* Drive ADC1-3 so the waveform reaches PB2, PB3 or PB4 */
+    for(i = 0; i < 3; i++) {
+        adc[i] = avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC1 + i);
+    }
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ,
+            ADC_IRQ_OUT_TRIGGER), ADCTrigger, NULL);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'),
+            IOPORT_IRQ_PIN0), PinChange, avr);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'),
+            IOPORT_IRQ_PIN1), PinChange, avr);
+    avr_register_io_write(avr, CLKPR_ADDR, ClockWrite, NULL);
+
+    state = cpu_Running;
+    while(SimTime(avr) < seconds && state != cpu_Done &&
+          state != cpu_Crashed) {
+        /* Piecewise constant waveform, bubbles start at the end of the
+         * first period so the firmware can calibrate on water */
+        ms = (uint64_t)(SimTime(avr) * 1000);
+        if(ms >= period && (ms % period) < width) {
+            mv = bubble;
+            if(!in_bubble) {
+                in_bubble = 1;
+                if(bench.waiting) {
+                    bench.misses++;
+                }
+                bench.onset_time = SimTime(avr);
+                bench.waiting = 1;
+                bench.onsets++;
+            }
+        } else {
+            mv = level;
+            in_bubble = 0;
+        }
+        if(mv != last_mv) {
+            for(i = 0; i < 3; i++) {
+                avr_raise_irq(adc[i], mv);
+            }
+            last_mv = mv;
+        }
+
+        /* A run that starts asleep only advances time to the next wakeup */
+        before = avr->cycle;
+        start = SimTime(avr);
+        sleeping = avr->state == cpu_Sleeping;
+        state = avr_run(avr);
+        if(sleeping) {
+            bench.sleep_cycles += avr->cycle - before;
+            bench.sleep_time += SimTime(avr) - start;
+        }
+    }
+    if(bench.waiting) {
+        bench.misses++;
+    }
+
+    /* Name the row after the directory holding main.elf */
+    strncpy(name, path, sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    printf("%s,%lu,%llu,%llu,%.4f,%lu,%llu,%.2f,%lu,%lu,%lu,%lu\n",
+           basename(dirname(name)),
+           (unsigned long)hz,
+           (unsigned long long)avr->cycle,
+           (unsigned long long)(avr->cycle - bench.sleep_cycles),
+           SimTime(avr) > 0 ? bench.sleep_time / SimTime(avr) : 0.0,
+           (unsigned long)bench.conversions,
+           bench.conversions ? (unsigned long long)
+                ((avr->cycle - bench.sleep_cycles) / bench.conversions) : 0ULL,
+           bench.onsets > bench.misses ?
+                bench.worst_latency * 1000 : -1.0,
+           (unsigned long)bench.misses,
+           (unsigned long)bench.onsets,
+           (unsigned long)f.flashsize,
+           (unsigned long)(f.datasize + f.bsssize));
+
+    avr_terminate(avr);
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    double seconds = RUN_SECONDS;
+    uint32_t hz = DEFAULT_HZ;
+    unsigned level = LEVEL_MV, bubble = BUBBLE_MV;
+    unsigned period = BUBBLE_PERIOD, width = BUBBLE_WIDTH;
+    int i, status = 0;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if(!strcmp(argv[i], "-f") && i + 1 < argc) {
+            hz = strtoul(argv[++i], NULL, 0);
+        } else if(!strcmp(argv[i], "-w") && i + 1 < argc &&
+                  sscanf(argv[++i], "%u:%u:%u:%u", &level, &bubble,
+                         &period, &width) == 4 && width < period) {
+            continue;
+        } else {
+            fprintf(stderr, "usage: %s [-t seconds] [-f hz] "
+                    "[-w level:bubble:period:width] main.elf ...\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("target,hz,cycles,active_cycles,sleep_fraction,conversions,"
+           "cycles_per_sample,worst_latency_ms,missed,bubbles,flash,ram\n");
+    for(; i < argc; i++) {
+        if(RunTarget(argv[i], seconds, hz, level, bubble, period, width)) {
+            status = 1;
+        }
+    }
+    return status;
+}
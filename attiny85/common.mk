@@ -0,0 +1,93 @@
+# Rules shared by the ATtiny85 project Makefiles, modified from the one
+# generated by CrossPack. A project sets OBJECTS, and CLOCK, OPTIONS,
+# DEFINES, FUSES or LIB_MODULES where it differs from the defaults, then
+# includes this.
+#
+# The driver library in ../lib is configured at compile time (pins, ADC
+# input, prescalers... see the lib headers), so each project builds its own
+# libtiny85.a from LIB_MODULES with its own OPTIONS. Everything is compiled
+# with -flto and linked with --gc-sections: the drivers are inlined into
+# their callers across files and whatever a project does not use is dropped.
+
+DEVICE     ?= attiny85
+# Internal 8MHz RC oscillator (see FUSES), divided down to CLOCK by
+# ClockInit. CLOCK must be OSC divided by a power of 2
+OSC        ?= 8000000
+CLOCK      ?= 125000
+PROGRAMMER ?= -c usbasp
+LIBDIR     ?= ../lib
+# Library modules the project uses, any of adc led tone
+LIB_MODULES ?=
+LIB_OBJECTS = $(LIB_MODULES:%=tiny_%.o)
+# for ATTiny85
+# see http://www.engbedded.com/fusecalc/
+#FUSES       = -U lfuse:w:0x62:m -U hfuse:w:0xdf:m -U efuse:w:0xff:m 
+FUSES      ?= -U lfuse:w:0xe2:m -U hfuse:w:0xdf:m -U efuse:w:0xff:m
+
+# Tune the lines below only if you know what you are doing:
+AVRDUDE = avrdude $(PROGRAMMER) -p $(DEVICE)
+COMPILE = avr-gcc -Wall -Os -flto -ffunction-sections -fdata-sections \
+          -DF_OSC=$(OSC) -DF_CPU=$(CLOCK) $(DEFINES) -mmcu=$(DEVICE) \
+          -I$(LIBDIR) $(OPTIONS)
+LDFLAGS = -Wl,--gc-sections
+# The archiver with the LTO plugin, so the archive keeps the LTO objects
+AR      = avr-gcc-ar
+
+# symbolic targets:
+all:	main.hex
+
+.c.o:
+	$(COMPILE) -c $< -o $@
+
+.S.o:
+	$(COMPILE) -x assembler-with-cpp -c $< -o $@
+
+.c.s:
+	$(COMPILE) -S $< -o $@
+
+tiny_%.o: $(LIBDIR)/%.c $(LIBDIR)/%.h $(LIBDIR)/tiny85.h
+	$(COMPILE) -c $< -o $@
+
+flash:	all
+	$(AVRDUDE) -U flash:w:main.hex:i
+
+fuse:
+	$(AVRDUDE) $(FUSES)
+
+# Xcode uses the Makefile targets "", "clean" and "install"
+install: flash fuse
+
+# if you use a bootloader, change the command below appropriately:
+load: all
+	bootloadHID main.hex
+
+# Flash and RAM use of the image
+size:	main.elf
+	avr-size --format=avr --mcu=$(DEVICE) main.elf
+
+clean::
+	rm -f main.hex main.elf libtiny85.a $(OBJECTS) $(LIB_OBJECTS)
+
+# file targets:
+$(OBJECTS): $(LIB_MODULES:%=$(LIBDIR)/%.h) $(LIBDIR)/tiny85.h
+
+libtiny85.a: $(LIB_OBJECTS)
+	rm -f libtiny85.a
+	$(AR) rcs libtiny85.a $(LIB_OBJECTS)
+
+main.elf: $(OBJECTS) libtiny85.a
+	$(COMPILE) $(LDFLAGS) -o main.elf $(OBJECTS) -L. -ltiny85
+
+main.hex: main.elf
+	rm -f main.hex
+	avr-objcopy -j .text -j .data -O ihex main.elf main.hex
+	avr-size --format=avr --mcu=$(DEVICE) main.elf
+# If you have an EEPROM section, you must also create a hex file for the
+# EEPROM and add it to the "flash" target.
+
+# Targets for code debugging and analysis:
+disasm:	main.elf
+	avr-objdump -d main.elf
+
+cpp:
+	$(COMPILE) -E main.c
@@ -0,0 +1,146 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/adc.c
+  * @brief   Single ended ADC input, see adc.h
+  ******************************************************************************
+  */
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "adc.h"
+
+#ifdef ADC_SLEEP
+// Result of the last conversion, written by ADC_vect
+volatile uint16_t adc_result;
+volatile uint8_t adc_done;
+#endif
+
+#ifdef ADC_QUEUE
+/* Sample ring, head written only by ADC_vect and tail only by ADCRead.
+ * The indices run freely and are masked on use, so head - tail is the
+ * number of samples queued */
+volatile adc_sample_t adc_queue[ADC_QUEUE_SIZE];
+volatile uint8_t adc_head;
+volatile uint8_t adc_tail;
+// Trigger periods since ADCStart
+uint16_t adc_time;
+#endif
+
+void ADCInit (void)
+{
+    /* Clear ADEN bit of register - halts all ADC processes */
+    cbi(ADCSRA, ADEN);
+    ADMUX = ADC_REF | ADC_ADLAR | ADC_MUX;
+    /* Auto trigger disabled */
+    ADCSRA = ADC_PS;
+
+    /* Enable ADC. Ref and channel selections will not go into effect until set */
+    sbi(ADCSRA, ADEN);
+}
+
+#ifdef ADC_QUEUE
+void ADCStart (void)
+{
+    TCCR0A = (1 << WGM01); /* CTC mode, TOP = OCR0A */
+    OCR0A = ADC_QUEUE_OCR;
+    /* Trigger source Timer0 compare match A */
+    ADCSRB = (0 << ADTS2) | (1 << ADTS1) | (1 << ADTS0);
+    /* Auto trigger and conversion complete interrupt enabled. Leave ADIF
+     * alone, writing it back as 1 would clear a pending conversion */
+    ADCSRA = (ADCSRA & ~(1 << ADIF)) | (1 << ADATE) | (1 << ADIE);
+    TCCR0B = ADC_QUEUE_CS;
+}
+
+uint8_t ADCRead (adc_sample_t *samples, uint8_t max)
+{
+    uint8_t tail = adc_tail;
+    /* Samples pushed after this read are left for the next call */
+    uint8_t count = adc_head - tail;
+    uint8_t i;
+
+    if(count > max) {
+        count = max;
+    }
+    for(i = 0; i < count; i++) {
+        samples[i] = adc_queue[tail++ & (ADC_QUEUE_SIZE - 1)];
+    }
+    /* Hands the slots back to ADC_vect only once they have been copied */
+    adc_tail = tail;
+
+    return count;
+}
+#else
+uint16_t ADCGet (void)
+{
+#ifdef ADC_SLEEP
+    /*
+     * Entering ADC noise reduction sleep starts the conversion and halts the
+     * CPU and I/O clocks until it completes. Other interrupts (e.g. the
+     * switch) can wake the core early, so sleep again until ADC_vect has run.
+     * The conversion already in progress is not restarted by sleeping again.
+     */
+    adc_done = 0;
+    sbi(ADCSRA, ADIE);
+    set_sleep_mode(SLEEP_MODE_ADC);
+    sleep_enable();
+    cli();
+    while(!adc_done) {
+        sei();
+        sleep_cpu();
+        cli();
+    }
+    sei();
+    sleep_disable();
+    cbi(ADCSRA, ADIE);
+
+    return adc_result;
+#else
+    sbi(ADCSRA, ADSC); /* Start conversion */
+    while(bit_is_set(ADCSRA, ADSC)); /* Wait for conversion to finish */
+
+    /* Reads ADCL before ADCH */
+    return ADC;
+#endif
+}
+#endif
+
+#ifdef ADC_SLEEP
+/**
+ * @brief ADC conversion complete interrupt, wakes ADCGet from noise
+ *        reduction sleep
+ * @param ADC_vect - ADC vector as specified for ATtiny85
+ * @return Nothing
+ */
+ISR(ADC_vect)
+{
+    adc_result = ADC;
+    adc_done = 1;
+}
+#endif
+
+#ifdef ADC_QUEUE
+/**
+ * @brief ADC conversion complete interrupt, queues the result. A full queue
+ *        drops it, which shows as a gap in the timestamps.
+ * @param ADC_vect - ADC vector as specified for ATtiny85
+ * @return Nothing
+ */
+ISR(ADC_vect)
+{
+    uint8_t head = adc_head;
+    uint8_t slot;
+
+    /* The trigger fires on the rising edge of OCF0A, which nothing else
+     * clears, so clear it for the next compare match */
+    TIFR = (1 << OCF0A);
+    if((uint8_t)(head - adc_tail) != ADC_QUEUE_SIZE) {
+        slot = head & (ADC_QUEUE_SIZE - 1);
+        adc_queue[slot].time = adc_time;
+        adc_queue[slot].value = ADC;
+        /* Published after the sample is written */
+        adc_head = head + 1;
+    }
+    adc_time++;
+}
+#endif
@@ -0,0 +1,116 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/adc.h
+  * @brief   Single ended ADC input. With -DADC_SLEEP ADCGet converts in ADC
+  *          noise reduction sleep and the library owns ADC_vect, otherwise
+  *          it spins on ADSC.
+  *          With -DADC_QUEUE Timer0 triggers a conversion every
+  *          1/ADC_QUEUE_HZ s instead, and ADC_vect only pushes the
+  *          timestamped result onto a ring that the main loop drains with
+  *          ADCRead. ADC_vect is the only writer of the head index and
+  *          ADCRead the only writer of the tail, both single bytes, so
+  *          neither side disables interrupts. The library owns Timer0 and
+  *          ADC_vect, and ADCGet is not available.
+  ******************************************************************************
+  */
+
+#ifndef ADC_H
+#define ADC_H
+
+#include "tiny85.h"
+
+/* REFS bits of ADMUX, the 1V1 internal reference by default */
+#ifndef ADC_REF
+#define ADC_REF         (1 << REFS1)
+#endif
+/* MUX bits of ADMUX, ADC1 (PB2) by default */
+#ifndef ADC_MUX
+#define ADC_MUX         1
+#endif
+/* ADC clock prescaler select, the smallest that keeps the ADC clock at or
+ * below 200kHz (F_CPU / 2, 62.5kHz at 125kHz) */
+#ifndef ADC_PS
+#define ADC_PS          (LOG2((F_CPU - 1) / 200000) + 1)
+#endif
+#if ADC_PS > 7
+#error "No ADC prescaler for this F_CPU"
+#endif
+/* With -DADC_LEFT the result is left adjusted, ADCH holds the top 8 bits */
+#ifdef ADC_LEFT
+#define ADC_ADLAR       (1 << ADLAR)
+#else
+#define ADC_ADLAR       0
+#endif
+
+#ifdef ADC_QUEUE
+#ifdef ADC_SLEEP
+#error "ADC_SLEEP and ADC_QUEUE both own ADC_vect"
+#endif
+/* Conversions per second */
+#ifndef ADC_QUEUE_HZ
+#define ADC_QUEUE_HZ    100
+#endif
+/* Ring length, a power of 2 up to 128 so the free running byte indices
+ * wrap cleanly. It must hold the samples taken during the longest time the
+ * main loop goes without calling ADCRead */
+#ifndef ADC_QUEUE_SIZE
+#define ADC_QUEUE_SIZE  16
+#endif
+#if ADC_QUEUE_SIZE > 128 || (ADC_QUEUE_SIZE & (ADC_QUEUE_SIZE - 1))
+#error "ADC_QUEUE_SIZE must be a power of 2 up to 128"
+#endif
+/* Timer0 clock select (CS0 = 1..5 divides by 1, 8, 64, 256, 1024), the
+ * smallest prescaler that fits the period in the 8 bit OCR0A */
+#define ADC_QUEUE_DIV   ((F_CPU + ADC_QUEUE_HZ / 2) / ADC_QUEUE_HZ)
+#define ADC_QUEUE_CS    (ADC_QUEUE_DIV <= 256UL ? 1 : \
+                         ADC_QUEUE_DIV <= 2048UL ? 2 : \
+                         ADC_QUEUE_DIV <= 16384UL ? 3 : \
+                         ADC_QUEUE_DIV <= 65536UL ? 4 : 5)
+#define ADC_QUEUE_PRESCALE (ADC_QUEUE_CS == 1 ? 1 : ADC_QUEUE_CS == 2 ? 8 : \
+                            ADC_QUEUE_CS == 3 ? 64 : \
+                            ADC_QUEUE_CS == 4 ? 256 : 1024)
+#define ADC_QUEUE_OCR   ((ADC_QUEUE_DIV + ADC_QUEUE_PRESCALE / 2) / \
+                         ADC_QUEUE_PRESCALE - 1)
+#if ADC_QUEUE_DIV > 262144UL
+#error "ADC_QUEUE_HZ too low for Timer0 at this F_CPU"
+#endif
+
+/* A queued conversion. time counts trigger periods, so a jump of more than
+ * one between samples shows the queue was full and samples were dropped */
+typedef struct {
+    uint16_t time;
+    uint16_t value;
+} adc_sample_t;
+#endif
+
+/**
+  * @brief  ADC initialisation. Sets the ADMUX and ADCSRA registers and
+  *         enables the ADC.
+  * @return Nothing
+  */
+void ADCInit (void);
+
+#ifdef ADC_QUEUE
+/**
+  * @brief  Starts Timer0 in CTC mode and the conversions it triggers. Call
+  *         after ADCInit, the samples are queued once interrupts are on.
+  * @return Nothing
+  */
+void ADCStart (void);
+
+/**
+  * @brief  Takes the oldest queued samples
+  * @param  samples - array to copy them to
+  * @param  max - most samples to take
+  * @return Number of samples taken, 0 if the queue is empty
+  */
+uint8_t ADCRead (adc_sample_t *samples, uint8_t max);
+#else
+/**
+  * @brief  Runs a conversion on the ADC_MUX input
+  * @return 10 bit result, or left adjusted with ADC_LEFT
+  */
+uint16_t ADCGet (void);
+#endif
+
+#endif /* ADC_H */
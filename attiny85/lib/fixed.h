@@ -0,0 +1,21 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/fixed.h
+  * @brief   Fixed point helpers shared by the ATtiny85 projects. Plain C
+  *          with no AVR headers, so the host builds can use them too.
+  ******************************************************************************
+  */
+
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <stdint.h>
+
+/* tenths/10 as an 8.8 fixed point factor, rounded */
+#define TENTHS_Q8(tenths) (((tenths) * 256UL + 5) / 10)
+/* Scales x by tenths/10 in 8.8 fixed point, e.g. SCALE_Q8(x, 8) = 0.8x.
+ * Used to precompute thresholds so the per-sample test is a single compare */
+#define SCALE_Q8(x, tenths) \
+    ((uint16_t)(((uint32_t)(x) * TENTHS_Q8(tenths)) >> 8))
+
+#endif /* FIXED_H */
@@ -0,0 +1,19 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/led.c
+  * @brief   Status LED, see led.h
+  ******************************************************************************
+  */
+
+#include <util/delay.h>
+
+#include "led.h"
+
+void BlinkLED (void)
+{
+    LEDSet(1);
+    _delay_ms(LED_ON_MS);
+
+    LEDSet(0);
+    _delay_ms(LED_OFF_MS);
+}
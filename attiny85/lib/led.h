@@ -0,0 +1,44 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/led.h
+  * @brief   Status LED on LED_PIN of port B. The pin must be set as an
+  *          output.
+  ******************************************************************************
+  */
+
+#ifndef LED_H
+#define LED_H
+
+#include "tiny85.h"
+
+#ifndef LED_PIN
+#define LED_PIN         PORTB0
+#endif
+#ifndef LED_ON_MS
+#define LED_ON_MS       200
+#endif
+#ifndef LED_OFF_MS
+#define LED_OFF_MS      100
+#endif
+
+/**
+  * @brief  Turns the LED on or off
+  * @param  on - non-zero for on
+  * @return Nothing
+  */
+static inline void LEDSet (uint8_t on)
+{
+    if(on) {
+        sbi(PORTB, LED_PIN);
+    } else {
+        cbi(PORTB, LED_PIN);
+    }
+}
+
+/**
+  * @brief  Blinks the LED once, on for LED_ON_MS then off for LED_OFF_MS
+  * @return Nothing
+  */
+void BlinkLED (void);
+
+#endif /* LED_H */
@@ -0,0 +1,66 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/tiny85.h
+  * @brief   Definitions shared by the ATtiny85 projects and the driver
+  *          library. Every driver is configured at compile time: the
+  *          settings are macros with defaults in each driver header, which a
+  *          project overrides with -D in its Makefile OPTIONS. The library
+  *          is built per project with those OPTIONS, see common.mk.
+  ******************************************************************************
+  */
+
+#ifndef TINY85_H
+#define TINY85_H
+
+#include <avr/io.h>
+#include <avr/sfr_defs.h>
+#include <stdint.h>
+
+#ifndef F_CPU
+#error "F_CPU is set by the Makefile"
+#endif
+/* Internal RC oscillator, divided down to F_CPU by ClockInit */
+#ifndef F_OSC
+#define F_OSC           8000000UL
+#endif
+
+// Define set bit and clear bit macros
+#define sbi(sfr,bit) (sfr |= _BV(bit))
+#define cbi(sfr,bit) (sfr &= ~(_BV(bit)))
+
+#define LOG2(x)         ((x) >= 256 ? 8 : (x) >= 128 ? 7 : (x) >= 64 ? 6 : \
+                         (x) >= 32 ? 5 : (x) >= 16 ? 4 : (x) >= 8 ? 3 : \
+                         (x) >= 4 ? 2 : (x) >= 2 ? 1 : 0)
+
+/* CLKPR prescaler select for F_CPU */
+#define CLOCK_PS        LOG2(F_OSC / F_CPU)
+#if F_OSC / F_CPU > 256 || (F_OSC >> CLOCK_PS) != F_CPU
+#error "F_CPU must be F_OSC divided by a power of 2 up to 256"
+#endif
+
+/**
+  * @brief  Sets the clock prescaler. The new value must be written within
+  *         four cycles of CLKPCE, so interrupts are held off around it.
+  * @param  ps - CLKPS bits, the oscillator is divided by 2^ps
+  * @return Nothing
+  */
+static inline void ClockPrescale (uint8_t ps)
+{
+    uint8_t sreg = SREG;
+
+    __asm__ __volatile__ ("cli" ::: "memory");
+    CLKPR = (1 << CLKPCE);
+    CLKPR = ps;
+    SREG = sreg;
+}
+
+/**
+  * @brief  Divides the oscillator down to F_CPU
+  * @return Nothing
+  */
+static inline void ClockInit (void)
+{
+    ClockPrescale(CLOCK_PS);
+}
+
+#endif /* TINY85_H */
@@ -0,0 +1,30 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/tone.c
+  * @brief   Blocking tone output, see tone.h
+  ******************************************************************************
+  */
+
+#include <util/delay.h>
+
+#include "tone.h"
+
+void PlayTone (uint8_t ocr, uint8_t duration)
+{
+    TCCR1 = (1 << CTC1) | (1 << COM1A0) | TONE_CS; /* Start OC */
+    OCR1C = ocr; /* set the OCR */
+    /* _delay_ms needs a constant to stay exact */
+    while(duration--) {
+        _delay_ms(1);
+    }
+    TCCR1 = (1 << CTC1) | (1 << COM1A0); /* stop the counter */
+}
+
+void PlayNotes (const uint8_t *notes, uint8_t count, uint8_t duration)
+{
+    uint8_t i;
+
+    for(i = 0; i < count; i++) {
+        PlayTone(notes[i], duration);
+    }
+}
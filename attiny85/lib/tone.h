@@ -0,0 +1,42 @@
+/**
+  ******************************************************************************
+  * @file    attiny85/lib/tone.h
+  * @brief   Blocking tone output on PB1 (OC1A) from Timer1 in CTC mode. The
+  *          pin must be set as an output. Notes are given as OCR values,
+  *          ocr = TONE_TIMER_HZ / (2 * note frequency).
+  ******************************************************************************
+  */
+
+#ifndef TONE_H
+#define TONE_H
+
+#include "tiny85.h"
+
+/* Timer1 count rate, 62.5kHz so the OCR values fit in 8 bits */
+#ifndef TONE_TIMER_HZ
+#define TONE_TIMER_HZ   62500UL
+#endif
+/* Timer1 clock select, CS1 = n divides F_CPU by 2^(n - 1) */
+#define TONE_CS         (LOG2(F_CPU / TONE_TIMER_HZ) + 1)
+#if (F_CPU >> (TONE_CS - 1)) != TONE_TIMER_HZ
+#error "TONE_TIMER_HZ must be F_CPU divided by a power of 2"
+#endif
+
+/**
+  * @brief  Plays a tone, returning once it has finished
+  * @param  ocr - OCR1C value for the note
+  * @param  duration - time in ms to play the note
+  * @return Nothing
+  */
+void PlayTone (uint8_t ocr, uint8_t duration);
+
+/**
+  * @brief  Plays a list of notes one after the other
+  * @param  notes - OCR1C value of each note
+  * @param  count - number of notes
+  * @param  duration - time in ms to play each note
+  * @return Nothing
+  */
+void PlayNotes (const uint8_t *notes, uint8_t count, uint8_t duration);
+
+#endif /* TONE_H */